@@ -11,6 +11,8 @@
 // qled -> ikLed
 // nr_micro_shell -> embush
 
+#include <stdlib.h>
+
 #include <rtconfig.h>
 #include <rtthread.h>
 #include <rtdevice.h>
@@ -31,18 +33,124 @@
 #define EMBOOT_DECOMPRESS_CACHE_SIZE    1024
 #endif
 
+#ifndef EMBOOT_OLD_CACHE_LINE
+#define EMBOOT_OLD_CACHE_LINE           256                 // bytes per line of the old image cache (diff decode).
+#endif
+#ifndef EMBOOT_OLD_CACHE_SETS
+#define EMBOOT_OLD_CACHE_SETS           4                   // 0: old image reads go to flash directly.
+#endif
+#ifndef EMBOOT_OLD_CACHE_WAYS
+#define EMBOOT_OLD_CACHE_WAYS           2
+#endif
+#ifndef EMBOOT_PATCH_AHEAD
+#define EMBOOT_PATCH_AHEAD              1024                // read-ahead buffer of the patch stream, 0: none.
+#endif
+#ifndef EMBOOT_NEW_BUFFER
+#define EMBOOT_NEW_BUFFER               256                 // decoder output is programmed in aligned pieces of this size (a multiple of the program page and the write granularity), 0: as it comes.
+#endif
+#ifndef EMBOOT_DECODE_REREAD
+#define EMBOOT_DECODE_REREAD            1                   // 0: check the decoded image by the crc of the decoder output, without reading [decode/newapp] back.
+#endif
+
 #ifndef EMBOOT_CRC_POLY
 #define EMBOOT_CRC_POLY                 0x04C11DB7          // CRC-32/MPEG-2
 #endif
 #ifndef EMBOOT_CRC_INIT
 #define EMBOOT_CRC_INIT                 0xFFFFFFFF          // CRC-32/MPEG-2
 #endif
+#ifndef EMBOOT_CRC_SLICE
+#define EMBOOT_CRC_SLICE                8                   // bytes per iteration: 1, 4 or 8 (slice-by-8 costs 8 KB of flash)
+#endif
+#ifndef EMBOOT_BLANK_MIN
+#define EMBOOT_BLANK_MIN                256                 // shortest erased run reported by the blank check (emboot_blank_set) that is hashed without reading it.
+#endif
 #ifndef EMBOOT_MOV_ADDR
 #define EMBOOT_MOV_ADDR                 1024                // copy the emboot header to the upctrl partition, offset xxx bytes.
 #endif
+#ifndef EMBOOT_RSM_ADDR
+#define EMBOOT_RSM_ADDR                 4096                // download progress log in the upctrl partition, offset xxx bytes (must start an erase block).
+#endif
+#ifndef EMBOOT_RSM_SIZE
+#define EMBOOT_RSM_SIZE                 (EMBOOT_RSM_ADDR + 2048 <= EMBOOT_JNL_ADDR ? 2048 : 0) // 8 bytes per chunk, 0: no resumable download.
+#endif
+#ifndef EMBOOT_RSM_CHUNK
+#define EMBOOT_RSM_CHUNK                4096                // bytes per logged chunk, a multiple of 1024 (ymodem-1k packet).
+#endif
+#ifndef EMBOOT_CKP_ADDR
+#define EMBOOT_CKP_ADDR                 6144                // flushed output log of the decode in the upctrl partition, offset xxx bytes (must start an erase block).
+#endif
+#ifndef EMBOOT_CKP_SIZE
+#define EMBOOT_CKP_SIZE                 (EMBOOT_CKP_ADDR + 2048 <= EMBOOT_JNL_ADDR ? 2048 : 0) // 8 bytes per chunk, 0: an interrupted decode programs all of [decode/newapp] again.
+#endif
+#ifndef EMBOOT_CKP_CHUNK
+#define EMBOOT_CKP_CHUNK                4096                // bytes of decoded output per logged chunk.
+#endif
+#ifndef EMBOOT_SWP_ADDR
+#define EMBOOT_SWP_ADDR                 8192                // sector swap progress log in the upctrl partition, offset xxx bytes (must start an erase block).
+#endif
+#ifndef EMBOOT_SWP_SIZE
+#define EMBOOT_SWP_SIZE                 (EMBOOT_SWP_ADDR + 8192 <= EMBOOT_JNL_ADDR ? 8192 : EMBOOT_SWP_ADDR < EMBOOT_JNL_ADDR ? EMBOOT_JNL_ADDR - EMBOOT_SWP_ADDR : 0) // 8 bytes per step, 3 steps per swapped sector.
+#endif
+#ifndef EMBOOT_JNL_ADDR
+#define EMBOOT_JNL_ADDR                 (__update_zone_size - EMBOOT_JNL_SIZE) // control block journal in the upctrl partition, offset xxx bytes (must start an erase block), the logs are sized to fit below it.
+#endif
+#ifndef EMBOOT_JNL_SIZE
+#define EMBOOT_JNL_SIZE                 (2 * EMBOOT_JNL_SECT) // 72 bytes per record, two journal sectors at least.
+#endif
+#ifndef EMBOOT_JNL_SECT
+#define EMBOOT_JNL_SECT                 2048                // bytes per journal sector, a multiple of the erase block of [upctrl].
+#endif
 #ifndef EMBOOT_MAX_TRYS
 #define EMBOOT_MAX_TRYS                 2
 #endif
+#ifndef EMBOOT_LAZY_ERASE
+#define EMBOOT_LAZY_ERASE               1                   // erase [dnload/backup] and [decode/newapp] sector by sector just ahead of the write cursor.
+#endif
+#ifndef EMBOOT_TRIM
+#define EMBOOT_TRIM                     1                   // backup, erase and copy only the used part of a partition (found by scanning its trailing erased space).
+#endif
+#ifndef EMBOOT_SKIP_SAME
+#define EMBOOT_SKIP_SAME                1                   // compare [curent/runapp] sector by sector before a copy, and leave the matching ones untouched.
+#endif
+#ifndef EMBOOT_AB_SLOT
+#define EMBOOT_AB_SLOT                  0                   // boot from [curent/runapp] or [decode/newapp], an update decodes into the other slot and switches over (no backup/copy).
+#endif
+#ifndef EMBOOT_SWAP_MODE
+#define EMBOOT_SWAP_MODE                0                   // exchange [curent/runapp] and [decode/newapp] sector by sector through [scratch], instead of backup + copy.
+#endif
+#ifndef EMBOOT_RYM_RING
+#define EMBOOT_RYM_RING                 0                   // packet buffers of the write-behind download (needs threads), 0: program every packet before acknowledging it.
+#endif
+#ifndef EMBOOT_RYM_WAIT
+#define EMBOOT_RYM_WAIT                 (RT_TICK_PER_SECOND * 5)    // longest time to hold back an acknowledge while the packet ring is full.
+#endif
+#ifndef EMBOOT_RYM_PRIO
+#define EMBOOT_RYM_PRIO                 (RT_THREAD_PRIORITY_MAX - 3)
+#endif
+#ifndef EMBOOT_WIN_FRAME
+#define EMBOOT_WIN_FRAME                2048                // payload bytes per frame of the windowed download ("download -w").
+#endif
+#ifndef EMBOOT_WIN_NUMS
+#define EMBOOT_WIN_NUMS                 8                   // frames the host may send ahead of the acknowledge (<= 32), bound by the rx buffer of the console.
+#endif
+#ifndef EMBOOT_WIN_WAIT
+#define EMBOOT_WIN_WAIT                 (RT_TICK_PER_SECOND * 1)
+#endif
+#ifndef EMBOOT_SLICE_BYTES
+#define EMBOOT_SLICE_BYTES              4096                // an update phase serves the console, led and watchdog (emboot_poll) after this many bytes, 0: not before it ends.
+#endif
+#ifndef EMBOOT_SLICE_TICKS
+#define EMBOOT_SLICE_TICKS              (RT_TICK_PER_SECOND / 50)   // ... or once this time is over, whichever comes first.
+#endif
+#ifndef EMBOOT_POLL_TICK
+#define EMBOOT_POLL_TICK                0                   // 1: emboot_poll runs emboot_tick (led and watchdog), 0: the board calls emboot_tick from an interrupt.
+#endif
+#ifndef EMBOOT_COPY_VERIFY
+#define EMBOOT_COPY_VERIFY              1                   // read back and compare every block right after it is written (replaces the verify pass).
+#endif
+#ifndef EMBOOT_AIO_BUFS
+#define EMBOOT_AIO_BUFS                 2                   // blocks in flight of the copies and hashes with asynchronous i/o (emboot_aio_set), 0: synchronous i/o only.
+#endif
 
 #ifndef EMBOOT_MSP_MASK
 #define EMBOOT_MSP_MASK                 0x00000000
@@ -76,6 +184,69 @@
 #define EMBOOT_DECODE_PART              "decode"
 #endif
 
+#ifndef EMBOOT_SCRATCH_PART
+#define EMBOOT_SCRATCH_PART             "scratch"           // swap mode only, one erase block of [curent/runapp] and [decode/newapp] at least.
+#endif
+
+#if EMBOOT_AB_SLOT && EMBOOT_SWAP_MODE
+#error "EMBOOT_AB_SLOT and EMBOOT_SWAP_MODE are alternatives, enable one of them!"
+#endif
+
+#if EMBOOT_AB_SLOT && !EMBOOT_DECODE_REREAD
+#error "A/B slot mode boots the decoded image without copying it, keep EMBOOT_DECODE_REREAD!"
+#endif
+
+#if EMBOOT_AB_SLOT && !defined(__decode_zone_addr)
+#error "A/B slot mode boots from [decode/newapp] too, the board must define __decode_zone_addr!"
+#endif
+
+#if EMBOOT_WIN_NUMS < 1 || EMBOOT_WIN_NUMS > 32
+#error "the acknowledge of the windowed download has a 32 bit bitmap of the frames behind the first one, EMBOOT_WIN_NUMS must be 1 to 32!"
+#endif
+
+#if EMBOOT_AIO_BUFS == 1
+#error "asynchronous i/o overlaps the blocks of a copy, EMBOOT_AIO_BUFS must be 2 at least (or 0)!"
+#endif
+
+#if EMBOOT_JNL_SIZE < 2 * EMBOOT_JNL_SECT || EMBOOT_JNL_SIZE % EMBOOT_JNL_SECT != 0
+#error "the control block journal needs two or more whole sectors of EMBOOT_JNL_SECT bytes!"
+#endif
+
+#if EMBOOT_JNL_ADDR + EMBOOT_JNL_SIZE > __update_zone_size
+#error "the control block journal must fit in [upctrl], EMBOOT_JNL_ADDR + EMBOOT_JNL_SIZE is beyond __update_zone_size!"
+#endif
+
+#if EMBOOT_MOV_ADDR + 1024 > EMBOOT_JNL_ADDR || (EMBOOT_RSM_SIZE && EMBOOT_RSM_ADDR + EMBOOT_RSM_SIZE > EMBOOT_JNL_ADDR) || \
+    (EMBOOT_CKP_SIZE && EMBOOT_CKP_ADDR + EMBOOT_CKP_SIZE > EMBOOT_JNL_ADDR) || (EMBOOT_SWAP_MODE && EMBOOT_SWP_ADDR + EMBOOT_SWP_SIZE > EMBOOT_JNL_ADDR)
+#error "the emboot header and the logs must lie below the control block journal, [upctrl] (__update_zone_size) is too small!"
+#endif
+
+#if EMBOOT_SWAP_MODE && EMBOOT_SWP_SIZE < 4 * 8
+#error "swap mode needs the sector swap log, [upctrl] (__update_zone_size) has no room for it below the journal!"
+#endif
+
+/**
+ * static partition table (optional): define EMBOOT_PART_TABLE as the fal partition entries of [upctrl], [curent/runapp],
+ * [dnload/backup], [decode/newapp] and [scratch] (swap mode only) in this order, and EMBOOT_PART_DEVS as the flash
+ * devices under them, e.g. in rtconfig.h:
+ *
+ *     #define EMBOOT_PART_TABLE    {{FAL_PART_MAGIC_WORD, "update", "onchip", 0x0000C000, 0x00004000, 0}, ...}
+ *     #define EMBOOT_PART_DEVS     &onchip_flash, &onchip_flash, &nor_flash, &nor_flash
+ *
+ * the partitions are then constants and are accessed through the ops of their flash devices, without fal lookups.
+ */
+#if defined(EMBOOT_PART_TABLE) && !defined(EMBOOT_PART_DEVS)
+#error "EMBOOT_PART_TABLE needs EMBOOT_PART_DEVS, the flash device of every partition in the table!"
+#endif
+
+#if EMBOOT_AB_SLOT
+#define EMBOOT_OLDAPP_ID                (emboot_slot ? emboot_part_decode : emboot_part_runapp)
+#define EMBOOT_NEWAPP_ID                (emboot_slot ? emboot_part_runapp : emboot_part_decode)
+#else
+#define EMBOOT_OLDAPP_ID                emboot_part_runapp
+#define EMBOOT_NEWAPP_ID                emboot_part_decode
+#endif
+
 #ifndef EMBOOT_EXPORT
 #define EMBOOT_EXPORT(cmd, func)        NR_SHELL_CMD_EXPORT(cmd, func)
 #endif
@@ -97,6 +268,25 @@
 #define emboot_bash(c)                  shell(c)
 #endif
 
+#ifndef emboot_yield
+#define emboot_yield()                  do {} while(0)      // board hook at every slice of an update phase.
+#endif
+
+#ifndef emboot_jump_arch
+#define emboot_jump_arch(msp, app)      do {\
+                                            __disable_irq();\
+                                            SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;\
+                                            for (int i = 0; i < sizeof(NVIC->ICER)/sizeof(NVIC->ICER[0]); ++i)\
+                                            {\
+                                                NVIC->ICER[i] = 0xFFFFFFFF;\
+                                                NVIC->ICPR[i] = 0xFFFFFFFF;\
+                                            }\
+                                            __set_CONTROL(0);\
+                                            __set_MSP(msp);\
+                                            ((void (*)(void))(app))();\
+                                        } while(0)
+#endif
+
 #ifndef emboot_printf_i
 #define emboot_printf_i(fmt, args...)   rt_kprintf(fmt, ##args);
 #endif
@@ -195,6 +385,7 @@ typedef struct hpatch_handle_t
 
     int patch_file_rd_pos;
     int newer_file_wr_pos;
+    int newer_file_pc_pos;          // next progress step
 
 } hpatch_handle_t;
 
@@ -202,248 +393,2173 @@ typedef int (*emboot_get_t)(unsigned int addr, unsigned char *data, unsigned int
 typedef int (*emboot_set_t)(unsigned int addr, unsigned char *data, unsigned int size);
 
 static unsigned char emboot_copy_buffer[1024];
+#if EMBOOT_COPY_VERIFY || EMBOOT_SKIP_SAME
+static unsigned char emboot_back_buffer[sizeof(emboot_copy_buffer)];
+#endif
 static unsigned char emboot_head_buffer[1024];
-static unsigned char emboot_ctrl_buffer[__update_zone_size];
+static emboot_ctrl_t emboot_ctrl_ram;                       // ram shadow of the control block, see emboot_ctrl_load
+static emboot_ctrl_t emboot_ctrl_rom;                       // the control block as journaled
+static int emboot_ctrl_loaded;
+#if EMBOOT_AB_SLOT
+static int emboot_slot;                                     // active slot, loaded by emboot_update
+#endif
+#if EMBOOT_SWAP_MODE
+static int emboot_swap_halt;                                // a swap stopped with [curent/runapp] broken, nothing more until a reset
+#endif
+
+/**
+ * partition handles: resolved by name once, fal_partition_find compares the name against the whole table.
+ */
+typedef enum emboot_part_t
+{
+    emboot_part_upctrl,
+    emboot_part_runapp,
+    emboot_part_backup,
+    emboot_part_decode,
+    emboot_part_scratch,
+    emboot_part_nums,
+} emboot_part_t;
+
+#ifdef EMBOOT_PART_TABLE
+static const struct fal_partition emboot_part_list[emboot_part_nums] = EMBOOT_PART_TABLE;
+static const struct fal_flash_dev *const emboot_part_devs[emboot_part_nums] = {EMBOOT_PART_DEVS};
+
+#define emboot_part(id)                 (&emboot_part_list[id])
+#define emboot_part_dev(part)           (emboot_part_devs[(part) - emboot_part_list])
+
+static int emboot_part_read(const struct fal_partition *part, uint32_t addr, uint8_t *buf, size_t size)
+{
+    if (addr + size > part->len) return -1;
+    return emboot_part_dev(part)->ops.read(part->offset + addr, buf, size);
+}
 
-static uint32_t embcrc_table[256];
-static uint32_t embcrc_mark;
+static int emboot_part_write(const struct fal_partition *part, uint32_t addr, const uint8_t *buf, size_t size)
+{
+    if (addr + size > part->len) return -1;
+    return emboot_part_dev(part)->ops.write(part->offset + addr, buf, size);
+}
+
+static int emboot_part_erase(const struct fal_partition *part, uint32_t addr, size_t size)
+{
+    if (addr + size > part->len) return -1;
+    return emboot_part_dev(part)->ops.erase(part->offset + addr, size);
+}
+#else
+static const char *const emboot_part_name[emboot_part_nums] = {EMBOOT_UPCTRL_PART, EMBOOT_RUNAPP_PART, EMBOOT_BACKUP_PART, EMBOOT_DECODE_PART, EMBOOT_SCRATCH_PART};
+static const struct fal_partition *emboot_part_list[emboot_part_nums];
+
+static const struct fal_partition *emboot_part(emboot_part_t id)
+{
+    if (emboot_part_list[id] == RT_NULL)
+    {
+        emboot_part_list[id] = fal_partition_find(emboot_part_name[id]);
+    }
+    return emboot_part_list[id];
+}
+
+#define emboot_part_dev(part)           fal_flash_device_find((part)->flash_name)
+#define emboot_part_read                fal_partition_read
+#define emboot_part_write               fal_partition_write
+#define emboot_part_erase               fal_partition_erase
+#endif
+
+static void emboot_slice(uint32_t bytes);
 
-static void embcrc_init(void)
+/**
+ * erases [addr, addr + size) one erase block at a time, an update phase is served between them (emboot_slice).
+ */
+static int emboot_part_erase_slice(const struct fal_partition *part, uint32_t addr, uint32_t size)
 {
-    for (uint32_t i = 0; i < 256; i++)
+    const struct fal_flash_dev *flash = emboot_part_dev(part);
+    uint32_t blks = (flash && flash->blk_size) ? flash->blk_size : size;
+    for (uint32_t len; size > 0; addr += len, size -= len)
     {
-        uint32_t crc = i << 24;
-        for (int k = 0; k < 8; k++)
+        len = size < blks ? size : blks;
+        if (emboot_part_erase(part, addr, len) < 0)
         {
-            if (crc & 0x80000000)
-            {
-                crc = (crc << 1) ^ EMBOOT_CRC_POLY;
-            }
-            else
-            {
-                crc <<= 1;
-            }
+            return -1;
         }
-        embcrc_table[i] = crc;
+        emboot_slice(len);                                  // an erase block takes milliseconds
+    }
+    return 0;
+}
+
+static int emboot_part_erase_all(const struct fal_partition *part)
+{
+    return part ? emboot_part_erase_slice(part, 0, part->len) : -1;
+}
+
+/**
+ * erases all of the partition but [addr, addr + size).
+ */
+static int emboot_part_erase_outside(const struct fal_partition *part, uint32_t addr, uint32_t size)
+{
+    if (part == RT_NULL)
+    {
+        return -1;
+    }
+    int result = 0;
+    if (addr > 0)
+    {
+        result |= emboot_part_erase_slice(part, 0, addr);
+    }
+    if (addr + size < part->len)
+    {
+        result |= emboot_part_erase_slice(part, addr + size, part->len - addr - size);
     }
+    return result < 0 ? -1 : 0;
 }
 
-static uint32_t embcrc(const uint8_t *data, size_t len, uint32_t crc)
+/**
+ * the crc tables are generated by the preprocessor and placed in flash.
+ *
+ * embcrc_table[k][i] is the crc of byte i followed by k zero bytes (starting from 0).
+ * table 0 is derived from EMBOOT_CRC_POLY directly, the others are linear combinations of x^(32+8k+b) mod poly.
+ */
+#define EMBCRC_STEP(c)                  (((c) << 1) ^ (((c) & 0x80000000) ? (uint32_t)EMBOOT_CRC_POLY : 0))
+#define EMBCRC_BYTE(c)                  EMBCRC_STEP(EMBCRC_STEP(EMBCRC_STEP(EMBCRC_STEP(EMBCRC_STEP(EMBCRC_STEP(EMBCRC_STEP(EMBCRC_STEP(c))))))))
+
+#define EMBCRC_LIN(i, b0, b1, b2, b3, b4, b5, b6, b7) \
+                                        ((((i) & 0x01) ? b0 : 0) ^ (((i) & 0x02) ? b1 : 0) ^ (((i) & 0x04) ? b2 : 0) ^ (((i) & 0x08) ? b3 : 0) ^ \
+                                         (((i) & 0x10) ? b4 : 0) ^ (((i) & 0x20) ? b5 : 0) ^ (((i) & 0x40) ? b6 : 0) ^ (((i) & 0x80) ? b7 : 0))
+#define EMBCRC_LIN_(i, ...)             EMBCRC_LIN(i, __VA_ARGS__)
+
+#define EMBCRC_X1                       0xD219C1DC, 0xA0F29E0F, 0x452421A9, 0x8A484352, 0x10519B13, 0x20A33626, 0x41466C4C, 0x828CD898
+#define EMBCRC_X2                       0x01D8AC87, 0x03B1590E, 0x0762B21C, 0x0EC56438, 0x1D8AC870, 0x3B1590E0, 0x762B21C0, 0xEC564380
+#define EMBCRC_X3                       0xDC6D9AB7, 0xBC1A28D9, 0x7CF54C05, 0xF9EA980A, 0xF7142DA3, 0xEAE946F1, 0xD1139055, 0xA6E63D1D
+#define EMBCRC_X4                       0x490D678D, 0x921ACF1A, 0x20F48383, 0x41E90706, 0x83D20E0C, 0x036501AF, 0x06CA035E, 0x0D9406BC
+#define EMBCRC_X5                       0x1B280D78, 0x36501AF0, 0x6CA035E0, 0xD9406BC0, 0xB641CA37, 0x684289D9, 0xD08513B2, 0xA5CB3AD3
+#define EMBCRC_X6                       0x4F576811, 0x9EAED022, 0x399CBDF3, 0x73397BE6, 0xE672F7CC, 0xC824F22F, 0x9488F9E9, 0x2DD0EE65
+#define EMBCRC_X7                       0x5BA1DCCA, 0xB743B994, 0x6A466E9F, 0xD48CDD3E, 0xADD8A7CB, 0x5F705221, 0xBEE0A442, 0x79005533
+
+#define EMBCRC_T0(i)                    EMBCRC_BYTE((uint32_t)(i) << 24)
+#define EMBCRC_T1(i)                    EMBCRC_LIN_(i, EMBCRC_X1)
+#define EMBCRC_T2(i)                    EMBCRC_LIN_(i, EMBCRC_X2)
+#define EMBCRC_T3(i)                    EMBCRC_LIN_(i, EMBCRC_X3)
+#define EMBCRC_T4(i)                    EMBCRC_LIN_(i, EMBCRC_X4)
+#define EMBCRC_T5(i)                    EMBCRC_LIN_(i, EMBCRC_X5)
+#define EMBCRC_T6(i)                    EMBCRC_LIN_(i, EMBCRC_X6)
+#define EMBCRC_T7(i)                    EMBCRC_LIN_(i, EMBCRC_X7)
+
+#define EMBCRC_R4(t, i)                 t((i) + 0x00), t((i) + 0x01), t((i) + 0x02), t((i) + 0x03)
+#define EMBCRC_R16(t, i)                EMBCRC_R4(t, (i) + 0x00), EMBCRC_R4(t, (i) + 0x04), EMBCRC_R4(t, (i) + 0x08), EMBCRC_R4(t, (i) + 0x0C)
+#define EMBCRC_R64(t, i)                EMBCRC_R16(t, (i) + 0x00), EMBCRC_R16(t, (i) + 0x10), EMBCRC_R16(t, (i) + 0x20), EMBCRC_R16(t, (i) + 0x30)
+#define EMBCRC_R256(t)                  {EMBCRC_R64(t, 0x00), EMBCRC_R64(t, 0x40), EMBCRC_R64(t, 0x80), EMBCRC_R64(t, 0xC0)}
+
+#if EMBOOT_CRC_SLICE != 1 && EMBOOT_CRC_SLICE != 4 && EMBOOT_CRC_SLICE != 8
+#error "EMBOOT_CRC_SLICE must be 1, 4 or 8!"
+#endif
+#if EMBOOT_CRC_SLICE != 1 && EMBOOT_CRC_POLY != 0x04C11DB7
+#error "the slice-by-n crc tables are generated for CRC-32/MPEG-2 only, set EMBOOT_CRC_SLICE to 1!"
+#endif
+
+static const uint32_t embcrc_table[EMBOOT_CRC_SLICE][256] =
+{
+    EMBCRC_R256(EMBCRC_T0),
+#if EMBOOT_CRC_SLICE >= 4
+    EMBCRC_R256(EMBCRC_T1),
+    EMBCRC_R256(EMBCRC_T2),
+    EMBCRC_R256(EMBCRC_T3),
+#endif
+#if EMBOOT_CRC_SLICE >= 8
+    EMBCRC_R256(EMBCRC_T4),
+    EMBCRC_R256(EMBCRC_T5),
+    EMBCRC_R256(EMBCRC_T6),
+    EMBCRC_R256(EMBCRC_T7),
+#endif
+};
+
+#define EMBCRC_BE32(p)                  (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+
+uint32_t embcrc(const uint8_t *data, size_t len, uint32_t crc)
 {
-    if (!embcrc_mark)
+#if EMBOOT_CRC_SLICE == 8
+    while (len >= 8)
+    {
+        uint32_t hi = crc ^ EMBCRC_BE32(data);
+        uint32_t lo = EMBCRC_BE32(data + 4);
+        crc = embcrc_table[7][hi >> 24] ^ embcrc_table[6][(hi >> 16) & 0xFF] ^ embcrc_table[5][(hi >> 8) & 0xFF] ^ embcrc_table[4][hi & 0xFF] ^
+              embcrc_table[3][lo >> 24] ^ embcrc_table[2][(lo >> 16) & 0xFF] ^ embcrc_table[1][(lo >> 8) & 0xFF] ^ embcrc_table[0][lo & 0xFF];
+        data += 8;
+        len  -= 8;
+    }
+#elif EMBOOT_CRC_SLICE == 4
+    while (len >= 4)
     {
-        embcrc_mark = 1;
-        embcrc_init();
+        uint32_t hi = crc ^ EMBCRC_BE32(data);
+        crc = embcrc_table[3][hi >> 24] ^ embcrc_table[2][(hi >> 16) & 0xFF] ^ embcrc_table[1][(hi >> 8) & 0xFF] ^ embcrc_table[0][hi & 0xFF];
+        data += 4;
+        len  -= 4;
     }
+#endif
 
     while (len--)
     {
-        crc = (crc << 8) ^ embcrc_table[((crc >> 24) ^ *data) & 0xFF];
+        crc = (crc << 8) ^ embcrc_table[0][((crc >> 24) ^ *data) & 0xFF];
         data++;
     }
 
     return crc;
 }
 
-static int emboot_calc_hash(int remain, int getpos, emboot_get_t embget)
+/**
+ * crc algebra: the register is not reflected and has no final xor, so feeding n zero bytes multiplies it by x^(8n)
+ * mod poly. the operators below run in O(log len) multiplications and never touch the data.
+ */
+static uint32_t embcrc_mulmod(uint32_t a, uint32_t b)
 {
-    int blkmax = sizeof(emboot_copy_buffer);
-    int blklen;
-    int pkglen = remain;
-    int pkgpos = 0;
-    int crcval = EMBOOT_CRC_INIT;
-
-    emboot_printf_i("00%%");
-    while (remain > 0)
+    uint32_t p = 0;
+    for (uint32_t m = 0x80000000; m; m >>= 1)
     {
-        int percent = pkgpos * 100 / pkglen;
-        if (percent % 5 == 0 && percent < 100)
+        p = EMBCRC_STEP(p);
+        if (b & m)
         {
-            emboot_printf_i("\b\b\b%02d%%", percent);
+            p ^= a;
         }
-
-        blklen = remain > blkmax ? blkmax : remain;
-        embget(getpos, emboot_copy_buffer, blklen);
-        crcval = embcrc(emboot_copy_buffer, blklen, crcval);
-        pkgpos += blklen;
-        getpos += blklen;
-        remain -= blklen;
     }
-    emboot_printf_i("\b\b\b100%% ");
+    return p;
+}
 
-    return crcval;
+/**
+ * register after len more zero bytes.
+ */
+uint32_t embcrc_shift(uint32_t crc, size_t len)
+{
+    for (uint32_t pw = 0x100; len && crc; len >>= 1)        // pw = x^(8 * 2^k)
+    {
+        if (len & 1)
+        {
+            crc = embcrc_mulmod(crc, pw);
+        }
+        pw = embcrc_mulmod(pw, pw);
+    }
+    return crc;
 }
 
-static int emboot_copy_data(int remain, int getpos, int setpos, emboot_get_t embget, emboot_set_t embset)
+/**
+ * register after len more erased (0xFF) bytes.
+ */
+uint32_t embcrc_ones(uint32_t crc, size_t len)
 {
-    int blkmax = sizeof(emboot_copy_buffer);
-    int blklen;
-    int pkglen = remain;
-    int pkgpos = 0;
+    uint32_t run = embcrc_table[0][0xFF];                   // crc of 2^k erased bytes, from 0
+    uint32_t acc = 0;
 
-    emboot_printf_i("00%%");
-    while (remain > 0)
+    for (uint32_t pw = 0x100; len; len >>= 1)
     {
-        int percent = pkgpos * 100 / pkglen;
-        if (percent % 5 == 0 && percent < 100)
+        if (len & 1)
         {
-            emboot_printf_i("\b\b\b%02d%%", percent);
+            crc = embcrc_mulmod(crc, pw);
+            acc = embcrc_mulmod(acc, pw) ^ run;
         }
-
-        blklen = remain > blkmax ? blkmax : remain;
-        embget(getpos, emboot_copy_buffer, blklen);
-        embset(setpos, emboot_copy_buffer, blklen);
-        pkgpos += blklen;
-        getpos += blklen;
-        setpos += blklen;
-        remain -= blklen;
+        run = embcrc_mulmod(run, pw) ^ run;
+        pw = embcrc_mulmod(pw, pw);
     }
-    emboot_printf_i("\b\b\b100%% ");
-    emboot_printf_d("(copied size = 0x%08X) ", pkglen);
-
-    return 0;
+    return crc ^ acc;
 }
 
-int emboot_upctrl_erase(void) { return fal_partition_erase_all(fal_partition_find(EMBOOT_UPCTRL_PART)); }
-int emboot_runapp_erase(void) { return fal_partition_erase_all(fal_partition_find(EMBOOT_RUNAPP_PART)); }
-int emboot_backup_erase(void) { return fal_partition_erase_all(fal_partition_find(EMBOOT_BACKUP_PART)); }
-int emboot_decode_erase(void) { return fal_partition_erase_all(fal_partition_find(EMBOOT_DECODE_PART)); }
+/**
+ * crc of a followed by b, from the crcs of both (each computed from EMBOOT_CRC_INIT) and the length of b.
+ */
+uint32_t embcrc_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b)
+{
+    return embcrc_shift(crc_a ^ EMBOOT_CRC_INIT, len_b) ^ crc_b;
+}
 
-int emboot_upctrl_read (unsigned int addr, unsigned char *data, unsigned int size) { return fal_partition_read (fal_partition_find(EMBOOT_UPCTRL_PART), addr, data, size); }
-int emboot_runapp_read (unsigned int addr, unsigned char *data, unsigned int size) { return fal_partition_read (fal_partition_find(EMBOOT_RUNAPP_PART), addr, data, size); }
-int emboot_backup_read (unsigned int addr, unsigned char *data, unsigned int size) { return fal_partition_read (fal_partition_find(EMBOOT_BACKUP_PART), addr, data, size); }
-int emboot_decode_read (unsigned int addr, unsigned char *data, unsigned int size) { return fal_partition_read (fal_partition_find(EMBOOT_DECODE_PART), addr, data, size); }
+static uint32_t embhash_soft_crc;
 
-int emboot_upctrl_write(unsigned int addr, unsigned char *data, unsigned int size) { return fal_partition_write(fal_partition_find(EMBOOT_UPCTRL_PART), addr, data, size); }
-int emboot_runapp_write(unsigned int addr, unsigned char *data, unsigned int size) { return fal_partition_write(fal_partition_find(EMBOOT_RUNAPP_PART), addr, data, size); }
-int emboot_backup_write(unsigned int addr, unsigned char *data, unsigned int size) { return fal_partition_write(fal_partition_find(EMBOOT_BACKUP_PART), addr, data, size); }
-int emboot_decode_write(unsigned int addr, unsigned char *data, unsigned int size) { return fal_partition_write(fal_partition_find(EMBOOT_DECODE_PART), addr, data, size); }
+static void embhash_soft_init(void)
+{
+    embhash_soft_crc = EMBOOT_CRC_INIT;
+}
 
-int embget_runapp_size(void)
+static void embhash_soft_update(const uint8_t *data, size_t size)
 {
-    const struct fal_partition *part = fal_partition_find(EMBOOT_RUNAPP_PART);
-    if (part == RT_NULL)
-    {
-        return 0;
-    }
-    return part->len;
+    embhash_soft_crc = embcrc(data, size, embhash_soft_crc);
 }
 
-int embget_runapp_data(void)
+static uint32_t embhash_soft_final(void)
 {
-    int data;
-    emboot_runapp_read(0, (uint8_t *)&data, sizeof(data));
-    return data;
+    return embhash_soft_crc;
 }
 
-int embset_update_step(emboot_step_t step, int erase)
+const emboot_hash_t emboot_hash_soft =
 {
-    if (erase)
-    {
-        emboot_ctrl_t *emboot_ctrl = (emboot_ctrl_t *)emboot_ctrl_buffer;
-        emboot_upctrl_read(0, emboot_ctrl_buffer, sizeof(emboot_ctrl_buffer));
-        emboot_ctrl->update_step = step;
-        emboot_upctrl_erase();
-        emboot_upctrl_write(0, emboot_ctrl_buffer, sizeof(emboot_ctrl_buffer));
-    }
-    else
-    {
-        emboot_ctrl_t emboot_ctrl = {0};
-        emboot_upctrl_read(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-        emboot_ctrl.update_step = step;
-        emboot_upctrl_write(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    }
-    return 0;
+    embhash_soft_init,
+    embhash_soft_update,
+    embhash_soft_final,
+};
+
+#ifdef EMBOOT_HASH_ENGINE
+extern const emboot_hash_t EMBOOT_HASH_ENGINE;      // e.g. a driver for the on-chip crc unit
+#else
+#define EMBOOT_HASH_ENGINE              emboot_hash_soft
+#endif
+
+static const emboot_hash_t *emboot_hash = &EMBOOT_HASH_ENGINE;
+
+void emboot_hash_set(const emboot_hash_t *hash)
+{
+    emboot_hash = hash ? hash : &EMBOOT_HASH_ENGINE;
 }
 
-int embget_update_step(void)
+static emboot_blank_t emboot_blank;
+
+void emboot_blank_set(emboot_blank_t blank)
 {
-    emboot_ctrl_t emboot_ctrl = {0};
-    emboot_upctrl_read(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    return emboot_ctrl.update_step;
+    emboot_blank = blank;
 }
 
-int embset_update_stay(int stay)
+static const struct fal_partition *emboot_get_part(emboot_get_t embget);
+#if EMBOOT_AIO_BUFS
+static const struct fal_partition *emboot_set_part(emboot_set_t embset);
+#endif
+
+/**
+ * return: length of the erased run at addr (at most size) if the blank check knows it and it is worth skipping, else 0.
+ */
+static uint32_t emboot_blank_run(const struct fal_partition *part, uint32_t addr, uint32_t size)
 {
-    emboot_ctrl_t emboot_ctrl = {0};
-    emboot_upctrl_read(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    emboot_ctrl.update_stay = stay;
-    emboot_upctrl_write(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    return 0;
+    if (emboot_blank == RT_NULL || part == RT_NULL || size < EMBOOT_BLANK_MIN)
+    {
+        return 0;
+    }
+
+    uint32_t run = emboot_blank(part, addr, size);
+    run = run > size ? size : run;
+    return run >= EMBOOT_BLANK_MIN ? run : 0;
 }
 
-int embget_update_stay(void)
+static const uint8_t *emboot_mmap_flag(const struct fal_partition *part)
 {
-    emboot_ctrl_t emboot_ctrl = {0};
-    emboot_upctrl_read(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    int stay = (int)emboot_ctrl.update_stay != -1 && (int)emboot_ctrl.update_stay != 0;
-    if (stay)
+    if ((part->reserved & EMBOOT_PART_MMAP) == 0)
     {
-        embset_update_stay(0);
+        return RT_NULL;
     }
-    return stay;
+
+    const struct fal_flash_dev *dev = emboot_part_dev(part);
+    return dev ? (const uint8_t *)(uintptr_t)(dev->addr + part->offset) : RT_NULL;
 }
 
-int embset_patchi_indx(int index)
+static emboot_mmap_t emboot_mmap = emboot_mmap_flag;
+
+void emboot_mmap_set(emboot_mmap_t mmap)
 {
-    emboot_ctrl_t emboot_ctrl = {0};
-    emboot_upctrl_read(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    emboot_ctrl.patchi_indx = index;
-    emboot_upctrl_write(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    return 0;
+    emboot_mmap = mmap ? mmap : emboot_mmap_flag;
 }
 
-int embget_patchi_indx(void)
+static const uint8_t *emboot_part_map(const struct fal_partition *part)
 {
-    emboot_ctrl_t emboot_ctrl = {0};
-    emboot_upctrl_read(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    return emboot_ctrl.patchi_indx;
+    return part ? emboot_mmap(part) : RT_NULL;
 }
 
-int embset_backup_info(uint32_t size, uint32_t hash)
+static int embaio_sync_read(const struct fal_partition *part, uint32_t addr, uint8_t *buf, size_t size, emboot_aio_done_t done, void *arg)
 {
-    emboot_ctrl_t emboot_ctrl = {0};
-    emboot_upctrl_read(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    emboot_ctrl.backup_size = size;
-    emboot_ctrl.backup_hash = hash;
-    emboot_upctrl_write(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
+    done(arg, emboot_part_read(part, addr, buf, size));
     return 0;
 }
 
-int embset_decode_info(uint32_t size, uint32_t hash)
+static int embaio_sync_write(const struct fal_partition *part, uint32_t addr, const uint8_t *buf, size_t size, emboot_aio_done_t done, void *arg)
 {
-    emboot_ctrl_t emboot_ctrl = {0};
-    emboot_upctrl_read(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
-    emboot_ctrl.decode_size = size;
-    emboot_ctrl.decode_hash = hash;
-    emboot_upctrl_write(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
+    done(arg, emboot_part_write(part, addr, buf, size));
     return 0;
 }
 
-hpi_BOOL hpatch_stream_read_empty(struct hpatchi_listener_t *listener, hpi_pos_t addr, hpi_byte *data, hpi_size_t size)
+const emboot_aio_t emboot_aio_sync =
 {
-    memset(data, 0, size);
-    return hpi_TRUE;
-}
+    embaio_sync_read,
+    embaio_sync_write,
+    RT_NULL,
+};
 
-hpi_BOOL hpatch_stream_read_old(struct hpatchi_listener_t *listener, hpi_pos_t addr, hpi_byte *data, hpi_size_t size)
+#ifdef EMBOOT_AIO_ENGINE
+extern const emboot_aio_t EMBOOT_AIO_ENGINE;        // e.g. a driver for the dma of the spi flash
+#define EMBOOT_AIO_DEFAULT              (&EMBOOT_AIO_ENGINE)
+#else
+#define EMBOOT_AIO_DEFAULT              RT_NULL
+#endif
+
+static const emboot_aio_t *emboot_aio = EMBOOT_AIO_DEFAULT;
+
+void emboot_aio_set(const emboot_aio_t *aio)
 {
-    int result = emboot_runapp_read(addr, data, size);
-    if (result < 0) { return hpi_FALSE; }
-    return hpi_TRUE;
+    emboot_aio = aio ? aio : EMBOOT_AIO_DEFAULT;
 }
 
-hpi_BOOL hpatch_stream_read_patch(hpi_TInputStreamHandle input_stream, hpi_byte *data, hpi_size_t *size)
+/**
+ * return: the data at pos, straight from the mapping if there is one, else read into buf.
+ */
+static const uint8_t *emboot_get_data(const uint8_t *map, emboot_get_t embget, int pos, uint8_t *buf, int len)
 {
-    hpatch_handle_t *hpatch = (hpatch_handle_t *)input_stream;
-
-    if ((hpatch->patch_file_rd_pos + *size) > hpatch->patch_file_length)
+    if (map)
     {
-        *size = hpatch->patch_file_length - hpatch->patch_file_rd_pos;
+        return map + pos;
     }
+    embget(pos, buf, len);
+    return buf;
+}
 
-    int result = emboot_backup_read(hpatch->patch_file_offset + hpatch->patch_file_rd_pos, data, *size);
-    if (result < 0) { return hpi_FALSE; }
+/**
+ * return: offset of the first differing byte, size if none. word by word while both are aligned.
+ */
+static int emboot_diff(const uint8_t *a, const uint8_t *b, int size)
+{
+    int i = 0;
+    if ((((uintptr_t)a | (uintptr_t)b) & 3) == 0)
+    {
+        while (i + 4 <= size && *(const uint32_t *)(a + i) == *(const uint32_t *)(b + i))
+        {
+            i += 4;
+        }
+    }
+    while (i < size && a[i] == b[i])
+    {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * image hash with erased runs left out: the engine hashes the data between the runs, which are added by embcrc_ones.
+ * as the engine cannot be seeded, every run closes its segment and the segments are joined by embcrc_combine.
+ */
+static uint32_t emboot_hash_head;                           // hash of everything before the current segment
+static uint32_t emboot_hash_size;                           // bytes in the current segment
+
+static void emboot_hash_begin(void)
+{
+    emboot_hash_head = EMBOOT_CRC_INIT;
+    emboot_hash_size = 0;
+    emboot_hash->init();
+}
+
+static void emboot_hash_data(const uint8_t *data, uint32_t size)
+{
+    emboot_hash->update(data, size);
+    emboot_hash_size += size;
+}
+
+static uint32_t emboot_hash_value(void)
+{
+    return emboot_hash_size ? embcrc_combine(emboot_hash_head, emboot_hash->final(), emboot_hash_size) : emboot_hash_head;
+}
+
+static void emboot_hash_blank(uint32_t size)
+{
+    emboot_hash_head = embcrc_ones(emboot_hash_value(), size);
+    emboot_hash_size = 0;
+    emboot_hash->init();
+}
+
+#if EMBOOT_AIO_BUFS
+/**
+ * asynchronous copies and hashes: the blocks go round a ring of EMBOOT_AIO_BUFS buffers. a block is read ahead into
+ * its buffer, hashed in order and programmed from it, then compared and retired once programmed, which frees the
+ * buffer for the read of a later block. the flash works on the next reads and the last program while the cpu hashes.
+ */
+typedef struct emboot_aio_blk_t
+{
+    uint8_t                            *buf;
+    const uint8_t                      *data;               // buf, the mapping, or RT_NULL for an erased run
+    int                                 pos;                // offset in the copy
+    int                                 len;
+    volatile int                        busy;               // an operation on the block is in flight
+    volatile int                        result;
+} emboot_aio_blk_t;
+
+static unsigned char emboot_aio_buffer[EMBOOT_AIO_BUFS - 1][sizeof(emboot_copy_buffer)];
+static emboot_aio_blk_t emboot_aio_ring[EMBOOT_AIO_BUFS];
+#if EMBOOT_COPY_VERIFY
+static emboot_aio_blk_t emboot_aio_back = {emboot_back_buffer};
+#endif
+
+static void emboot_aio_done(void *arg, int result)
+{
+    emboot_aio_blk_t *blk = arg;
+    blk->result = result;
+    blk->busy = 0;
+}
+
+static int emboot_aio_wait(emboot_aio_blk_t *blk)
+{
+    while (blk->busy)
+    {
+        if (emboot_aio->idle)
+        {
+            emboot_aio->idle();
+        }
+    }
+    return blk->result;
+}
+
+/**
+ * an operation the driver cannot start runs in place.
+ */
+static void emboot_aio_read(emboot_aio_blk_t *blk, const struct fal_partition *part, uint32_t addr)
+{
+    blk->busy = 1;
+    if (emboot_aio->read(part, addr, blk->buf, blk->len, emboot_aio_done, blk) < 0)
+    {
+        emboot_aio_done(blk, emboot_part_read(part, addr, blk->buf, blk->len));
+    }
+}
+
+static void emboot_aio_write(emboot_aio_blk_t *blk, const struct fal_partition *part, uint32_t addr)
+{
+    blk->busy = 1;
+    if (emboot_aio->write(part, addr, blk->data, blk->len, emboot_aio_done, blk) < 0)
+    {
+        emboot_aio_done(blk, emboot_part_write(part, addr, blk->data, blk->len));
+    }
+}
+
+/**
+ * emboot_copy_data, or emboot_calc_hash if embset is RT_NULL, on asynchronous i/o. embget must read a partition,
+ * embset is programmed behind if it writes one, else it is called in place.
+ */
+static int emboot_copy_aio(int remain, int getpos, int setpos, emboot_get_t embget, emboot_set_t embset, emboot_get_t embchk, uint32_t *hash)
+{
+    int blkmax = sizeof(emboot_copy_buffer);
+    int pkglen = remain;
+    int plan = 0;                                           // blocks planned (read ahead)
+    int hand = 0;                                           // blocks handed over (hashed and programmed)
+    int done = 0;                                           // blocks retired (compared)
+    int next = 0;                                           // offset of the next block to plan
+    int result = -1;
+    const struct fal_partition *part = emboot_get_part(embget);
+    const struct fal_partition *src = (embchk || !embset) ? part : RT_NULL;
+    const struct fal_partition *dst = embchk ? emboot_get_part(embchk) : RT_NULL;
+    const struct fal_partition *out = embset ? emboot_set_part(embset) : RT_NULL;
+    const uint8_t *src_map = emboot_part_map(part);
+    const uint8_t *dst_map = emboot_part_map(dst);
+
+    for (int i = 0; i < EMBOOT_AIO_BUFS; ++i)
+    {
+        emboot_aio_ring[i].buf = i ? emboot_aio_buffer[i - 1] : emboot_copy_buffer;
+        emboot_aio_ring[i].busy = 0;
+    }
+
+    if (hash)
+    {
+        emboot_hash_begin();
+    }
+
+    emboot_printf_i("00%%");
+    while (done < plan || next < pkglen)
+    {
+        emboot_aio_blk_t *blk;
+
+        if (plan - done < EMBOOT_AIO_BUFS && next < pkglen)
+        {
+            blk = &emboot_aio_ring[plan++ % EMBOOT_AIO_BUFS];
+            int run = emboot_blank_run(src, getpos + next, pkglen - next);
+            if (run > 0 && embset)
+            {
+                run = emboot_blank_run(dst, setpos + next, run);
+            }
+            blk->pos  = next;
+            blk->len  = run > 0 ? run : pkglen - next > blkmax ? blkmax : pkglen - next;
+            blk->data = run > 0 ? RT_NULL : src_map ? src_map + getpos + next : blk->buf;
+            if (blk->data == blk->buf)
+            {
+                emboot_aio_read(blk, part, getpos + next);
+            }
+            next += blk->len;
+            continue;
+        }
+
+        // retire the oldest block once it is programmed, or if there is nothing else to do but wait for it.
+        blk = &emboot_aio_ring[done % EMBOOT_AIO_BUFS];
+        if (done < hand && (!blk->busy || hand == plan))
+        {
+            done++;
+            emboot_aio_wait(blk);
+#if EMBOOT_COPY_VERIFY
+            if (embchk && blk->data)
+            {
+                const uint8_t *back = dst_map ? dst_map + setpos + blk->pos : emboot_aio_back.buf;
+                if (dst_map == RT_NULL)
+                {
+                    emboot_aio_back.len = blk->len;
+                    if (dst)
+                    {
+                        emboot_aio_read(&emboot_aio_back, dst, setpos + blk->pos);
+                        emboot_aio_wait(&emboot_aio_back);
+                    }
+                    else
+                    {
+                        embchk(setpos + blk->pos, emboot_aio_back.buf, blk->len);
+                    }
+                }
+                int i = emboot_diff(blk->data, back, blk->len);
+                if (i < blk->len)
+                {
+                    emboot_printf_i("\b\b\b%02d%% ", blk->pos * 100 / pkglen);
+                    emboot_printf_d("(mismatch at 0x%08X) ", blk->pos + i);
+                    result = blk->pos + i;
+                    break;
+                }
+            }
+#endif
+            continue;
+        }
+
+        blk = &emboot_aio_ring[hand++ % EMBOOT_AIO_BUFS];
+        int percent = blk->pos * 100 / pkglen;
+        if (percent % 5 == 0 && percent < 100)
+        {
+            emboot_printf_i("\b\b\b%02d%%", percent);
+        }
+        emboot_aio_wait(blk);
+        if (blk->data == RT_NULL)
+        {
+            if (hash)
+            {
+                emboot_hash_blank(blk->len);
+            }
+        }
+        else
+        {
+            if (hash)
+            {
+                emboot_hash_data(blk->data, blk->len);
+            }
+            if (out)
+            {
+                emboot_aio_write(blk, out, setpos + blk->pos);
+            }
+            else if (embset)
+            {
+                embset(setpos + blk->pos, (unsigned char *)blk->data, blk->len);
+            }
+        }
+        emboot_slice(blk->len);
+    }
+
+    // nothing may land in the buffers once they are handed back.
+    for (int i = 0; i < EMBOOT_AIO_BUFS; ++i)
+    {
+        emboot_aio_wait(&emboot_aio_ring[i]);
+    }
+    if (result >= 0)
+    {
+        return result;
+    }
+
+    emboot_printf_i("\b\b\b100%% ");
+    if (embset)
+    {
+        emboot_printf_d("(copied size = 0x%08X) ", pkglen);
+    }
+
+    if (hash)
+    {
+        *hash = emboot_hash_value();
+    }
+
+    return -1;
+}
+#endif
+
+static int emboot_calc_hash(int remain, int getpos, emboot_get_t embget)
+{
+    int blkmax = sizeof(emboot_copy_buffer);
+    int blklen;
+    int pkglen = remain;
+    int pkgpos = 0;
+    const struct fal_partition *part = emboot_get_part(embget);
+    const uint8_t *map = emboot_part_map(part);
+
+#if EMBOOT_AIO_BUFS
+    if (emboot_aio && part && map == RT_NULL)
+    {
+        uint32_t hash;
+        emboot_copy_aio(remain, getpos, 0, embget, RT_NULL, RT_NULL, &hash);
+        return hash;
+    }
+#endif
+
+    emboot_hash_begin();
+
+    emboot_printf_i("00%%");
+    while (remain > 0)
+    {
+        int percent = pkgpos * 100 / pkglen;
+        if (percent % 5 == 0 && percent < 100)
+        {
+            emboot_printf_i("\b\b\b%02d%%", percent);
+        }
+
+        if ((blklen = emboot_blank_run(part, getpos, remain)) > 0)
+        {
+            emboot_hash_blank(blklen);
+        }
+        else
+        {
+            blklen = remain > blkmax ? blkmax : remain;
+            emboot_hash_data(emboot_get_data(map, embget, getpos, emboot_copy_buffer, blklen), blklen);
+        }
+        pkgpos += blklen;
+        getpos += blklen;
+        remain -= blklen;
+        emboot_slice(blklen);
+    }
+    emboot_printf_i("\b\b\b100%% ");
+
+    return emboot_hash_value();
+}
+
+#define EMBOOT_PATCHX_MAX               ((sizeof(emboot_head_buffer) - sizeof(emboot_head_t)) / sizeof(patchi_data_t))
+
+/**
+ * matches the old image read by embget against the old images of all the package entries in one pass.
+ * the cutoffs are visited in ascending order of oldapp_size and the running hash is taken at each of them.
+ * returns the first entry (in package order) that matches, -1 if none does.
+ */
+static int emboot_match_oldapp(emboot_head_t *emboot_head, emboot_get_t embget)
+{
+    uint8_t  order[EMBOOT_PATCHX_MAX];  // entries to hash, by size
+    int8_t   match[EMBOOT_PATCHX_MAX];  // 1: matched, 0: not matched, -1: not reached yet
+    int all  = emboot_head->patchx_nums < EMBOOT_PATCHX_MAX ? emboot_head->patchx_nums : EMBOOT_PATCHX_MAX;
+    int nums = all;
+    int cnt  = 0;
+
+    // entries without an old image match anything, the ones behind the first of them are never chosen.
+    for (int i = 0; i < nums; ++i)
+    {
+        uint32_t size = emboot_head->patchx_data[i].oldapp_size;
+        if (size == 0x00000000 || size == 0xFFFFFFFF)
+        {
+            nums = i;
+            break;
+        }
+
+        int k = cnt++;
+        while (k > 0 && emboot_head->patchx_data[order[k - 1]].oldapp_size > size)
+        {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+        match[i] = -1;
+    }
+    int last = nums < all ? nums : -1;
+
+    int blkmax = sizeof(emboot_copy_buffer);
+    int pkglen = cnt ? emboot_head->patchx_data[order[cnt - 1]].oldapp_size : 0;
+    int pkgpos = 0;
+    int next = 0;
+    const struct fal_partition *part = emboot_get_part(embget);
+    const uint8_t *map = emboot_part_map(part);
+
+    emboot_hash_begin();
+
+    emboot_printf_i("00%%");
+    while (next < cnt)
+    {
+        int cutoff = emboot_head->patchx_data[order[next]].oldapp_size;
+        if (pkgpos < cutoff)
+        {
+            int percent = pkgpos * 100 / pkglen;
+            if (percent % 5 == 0 && percent < 100)
+            {
+                emboot_printf_i("\b\b\b%02d%%", percent);
+            }
+
+            int blklen = emboot_blank_run(part, pkgpos, cutoff - pkgpos);
+            if (blklen > 0)
+            {
+                emboot_hash_blank(blklen);
+            }
+            else
+            {
+                blklen = cutoff - pkgpos > blkmax ? blkmax : cutoff - pkgpos;
+                emboot_hash_data(emboot_get_data(map, embget, pkgpos, emboot_copy_buffer, blklen), blklen);
+            }
+            pkgpos += blklen;
+            emboot_slice(blklen);
+            continue;
+        }
+
+        uint32_t hash = emboot_hash_value();
+        for (; next < cnt && emboot_head->patchx_data[order[next]].oldapp_size == cutoff; ++next)
+        {
+            match[order[next]] = emboot_head->patchx_data[order[next]].oldapp_hash == hash;
+        }
+
+        // stop as soon as the first undecided entry in package order is known to match.
+        for (int i = 0; i < nums && match[i] >= 0; ++i)
+        {
+            if (match[i] == 1)
+            {
+                emboot_printf_i("\b\b\b100%% ");
+                return i;
+            }
+        }
+    }
+    emboot_printf_i("\b\b\b100%% ");
+
+    return last;
+}
+
+/**
+ * copies remain bytes from getpos to setpos. if hash is given, the source is hashed on the way.
+ * if embchk is given (and EMBOOT_COPY_VERIFY is enabled), every block is read back and compared right after it is written.
+ * if embchk is given, erased runs found by the blank check on both sides are neither read nor programmed.
+ * with asynchronous i/o (emboot_aio_set) the blocks are pipelined, see emboot_copy_aio.
+ *
+ * return: offset of the first mismatching byte, or -1 if the copy is good.
+ */
+static int emboot_copy_data(int remain, int getpos, int setpos, emboot_get_t embget, emboot_set_t embset, emboot_get_t embchk, uint32_t *hash)
+{
+    int blkmax = sizeof(emboot_copy_buffer);
+    int blklen;
+    int pkglen = remain;
+    int pkgpos = 0;
+    const struct fal_partition *src = embchk ? emboot_get_part(embget) : RT_NULL;
+    const struct fal_partition *dst = embchk ? emboot_get_part(embchk) : RT_NULL;
+    const uint8_t *src_map = emboot_part_map(emboot_get_part(embget));
+    const uint8_t *dst_map = emboot_part_map(dst);
+
+#if EMBOOT_AIO_BUFS
+    if (emboot_aio && emboot_get_part(embget))
+    {
+        return emboot_copy_aio(remain, getpos, setpos, embget, embset, embchk, hash);
+    }
+#endif
+
+    if (hash)
+    {
+        emboot_hash_begin();
+    }
+
+    emboot_printf_i("00%%");
+    while (remain > 0)
+    {
+        int percent = pkgpos * 100 / pkglen;
+        if (percent % 5 == 0 && percent < 100)
+        {
+            emboot_printf_i("\b\b\b%02d%%", percent);
+        }
+
+        if ((blklen = emboot_blank_run(src, getpos, remain)) > 0 &&
+            (blklen = emboot_blank_run(dst, setpos, blklen)) > 0)
+        {
+            if (hash)
+            {
+                emboot_hash_blank(blklen);
+            }
+            pkgpos += blklen;
+            getpos += blklen;
+            setpos += blklen;
+            remain -= blklen;
+            emboot_slice(blklen);
+            continue;
+        }
+
+        blklen = remain > blkmax ? blkmax : remain;
+        const uint8_t *data = emboot_get_data(src_map, embget, getpos, emboot_copy_buffer, blklen);
+        if (hash)
+        {
+            emboot_hash_data(data, blklen);
+        }
+        embset(setpos, (unsigned char *)data, blklen);
+#if EMBOOT_COPY_VERIFY
+        if (embchk)
+        {
+            int i = emboot_diff(data, emboot_get_data(dst_map, embchk, setpos, emboot_back_buffer, blklen), blklen);
+            if (i < blklen)
+            {
+                emboot_printf_i("\b\b\b%02d%% ", percent);
+                emboot_printf_d("(mismatch at 0x%08X) ", pkgpos + i);
+                return pkgpos + i;
+            }
+        }
+#endif
+        pkgpos += blklen;
+        getpos += blklen;
+        setpos += blklen;
+        remain -= blklen;
+        emboot_slice(blklen);
+    }
+    emboot_printf_i("\b\b\b100%% ");
+    emboot_printf_d("(copied size = 0x%08X) ", pkglen);
+
+    if (hash)
+    {
+        *hash = emboot_hash_value();
+    }
+
+    return -1;
+}
+
+int emboot_upctrl_erase(void) { return emboot_part_erase_outside(emboot_part(emboot_part_upctrl), EMBOOT_JNL_ADDR, EMBOOT_JNL_SIZE); }
+int emboot_runapp_erase(void) { return emboot_part_erase_all(emboot_part(emboot_part_runapp)); }
+int emboot_backup_erase(void) { return emboot_part_erase_all(emboot_part(emboot_part_backup)); }
+int emboot_decode_erase(void) { return emboot_part_erase_all(emboot_part(emboot_part_decode)); }
+
+int emboot_upctrl_read (unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_read (emboot_part(emboot_part_upctrl), addr, data, size); }
+int emboot_runapp_read (unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_read (emboot_part(emboot_part_runapp), addr, data, size); }
+int emboot_backup_read (unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_read (emboot_part(emboot_part_backup), addr, data, size); }
+int emboot_decode_read (unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_read (emboot_part(emboot_part_decode), addr, data, size); }
+
+int emboot_oldapp_read (unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_read (emboot_part(EMBOOT_OLDAPP_ID), addr, data, size); }
+int emboot_newapp_read (unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_read (emboot_part(EMBOOT_NEWAPP_ID), addr, data, size); }
+
+static const struct fal_partition *emboot_get_part(emboot_get_t embget)
+{
+    if (embget == emboot_runapp_read) return emboot_part(emboot_part_runapp);
+    if (embget == emboot_backup_read) return emboot_part(emboot_part_backup);
+    if (embget == emboot_decode_read) return emboot_part(emboot_part_decode);
+    if (embget == emboot_oldapp_read) return emboot_part(EMBOOT_OLDAPP_ID);
+    if (embget == emboot_newapp_read) return emboot_part(EMBOOT_NEWAPP_ID);
+    return RT_NULL;
+}
+
+int emboot_upctrl_write(unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_write(emboot_part(emboot_part_upctrl), addr, data, size); }
+int emboot_runapp_write(unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_write(emboot_part(emboot_part_runapp), addr, data, size); }
+int emboot_backup_write(unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_write(emboot_part(emboot_part_backup), addr, data, size); }
+int emboot_decode_write(unsigned int addr, unsigned char *data, unsigned int size) { return emboot_part_write(emboot_part(emboot_part_decode), addr, data, size); }
+
+#if EMBOOT_AIO_BUFS
+static const struct fal_partition *emboot_set_part(emboot_set_t embset)
+{
+    if (embset == emboot_runapp_write) return emboot_part(emboot_part_runapp);
+    if (embset == emboot_backup_write) return emboot_part(emboot_part_backup);
+    if (embset == emboot_decode_write) return emboot_part(emboot_part_decode);
+    return RT_NULL;
+}
+#endif
+
+/**
+ * progress logs in [upctrl] are arrays of records, each written once. a record is valid if mark == ~data, so an
+ * erased or half programmed one never is.
+ */
+typedef struct emboot_rec_t
+{
+    uint32_t                            data;
+    uint32_t                            mark;
+} emboot_rec_t;
+
+static int emboot_rec_get(uint32_t base, int index, uint32_t *data)
+{
+    emboot_rec_t rec;
+    emboot_upctrl_read(base + index * sizeof(rec), (uint8_t *)&rec, sizeof(rec));
+    *data = rec.data;
+    return rec.mark == ~rec.data ? 0 : -1;
+}
+
+static int emboot_rec_set(uint32_t base, int index, uint32_t data)
+{
+    emboot_rec_t rec = {data, ~data};
+    return emboot_upctrl_write(base + index * sizeof(rec), (uint8_t *)&rec, sizeof(rec));
+}
+
+/**
+ * erase on demand: everything below "erased" has been erased, sectors above are erased only when a write reaches them.
+ */
+typedef struct emboot_lazy_t
+{
+    const struct fal_partition         *part;
+    uint32_t                            blks;               // erase granularity
+    uint32_t                            erased;
+} emboot_lazy_t;
+
+static uint32_t emboot_lazy_blks(const struct fal_partition *part)
+{
+    const struct fal_flash_dev *flash = emboot_part_dev(part);
+    return (flash && flash->blk_size) ? flash->blk_size : part->len;
+}
+
+/**
+ * everything below from (a multiple of the erase block) is kept.
+ */
+static int emboot_lazy_init(emboot_lazy_t *lazy, emboot_part_t id, uint32_t from)
+{
+    lazy->part = emboot_part(id);
+    if (lazy->part == RT_NULL)
+    {
+        return -1;
+    }
+
+    lazy->blks = emboot_lazy_blks(lazy->part);
+    lazy->erased = from;
+
+#if !EMBOOT_LAZY_ERASE
+    emboot_part_erase_slice(lazy->part, from, lazy->part->len - from);
+    lazy->erased = lazy->part->len;
+#endif
+    return 0;
+}
+
+static int emboot_lazy_write(emboot_lazy_t *lazy, uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    if (addr + size > lazy->erased)
+    {
+        uint32_t end = (addr + size + lazy->blks - 1) / lazy->blks * lazy->blks;
+        if (end > lazy->part->len)
+        {
+            end = lazy->part->len;
+        }
+        if (emboot_part_erase(lazy->part, lazy->erased, end - lazy->erased) < 0)
+        {
+            return -1;
+        }
+        lazy->erased = end;
+    }
+    return emboot_part_write(lazy->part, addr, data, size);
+}
+
+static emboot_lazy_t emboot_decode_lazy;
+
+/**
+ * flushed output log at [upctrl:EMBOOT_CKP_ADDR]: records 0 and 1 hold the hash and size of the image being decoded,
+ * record n+2 the crc of chunk n of [decode/newapp] once it is programmed. after a reset the output below the logged
+ * chunks is not erased and programmed again, the decode itself is not resumed: hpatch keeps its decoder state to
+ * itself, so the patch is read and decoded from its start and the output below the resume point is dropped.
+ *
+ * a decoder checkpoint (patch_file_rd_pos, newer_file_wr_pos and the decompressor and cover state at a restart point
+ * of hpi_patch, a single blocking call) needs support from hpatchlite and is not done here.
+ */
+#define EMBOOT_CKP_HEAD                 2
+#define EMBOOT_CKP_NUMS                 (EMBOOT_CKP_SIZE / sizeof(emboot_rec_t) - EMBOOT_CKP_HEAD)
+
+static uint32_t emboot_ckp_from;                            // resume offset of the current decode
+static uint32_t emboot_ckp_hash;                            // crc of the chunk being decoded
+static uint32_t emboot_ckp_head;                            // crc of [decode/newapp] below emboot_ckp_from, joined from the logged chunks
+static uint32_t emboot_ckp_head_size;                       // bytes covered by emboot_ckp_head
+static uint32_t emboot_ckp_limit = 0xFFFFFFFF;              // the next scan stops here (a bad block found by the last verify, 0: start over)
+
+static int emboot_ckp_erase(void)
+{
+    if (EMBOOT_CKP_SIZE == 0) return 0;
+    return emboot_part_erase_slice(emboot_part(emboot_part_upctrl), EMBOOT_CKP_ADDR, EMBOOT_CKP_SIZE);
+}
+
+static uint32_t emboot_ckp_chunk(const struct fal_partition *part, uint32_t from)
+{
+    uint32_t hash = EMBOOT_CRC_INIT;
+    for (uint32_t pos = 0; pos < EMBOOT_CKP_CHUNK; pos += sizeof(emboot_copy_buffer))
+    {
+        emboot_part_read(part, from + pos, emboot_copy_buffer, sizeof(emboot_copy_buffer));
+        hash = embcrc(emboot_copy_buffer, sizeof(emboot_copy_buffer), hash);
+    }
+    return hash;
+}
+
+/**
+ * checks the logged chunks of the same image (hash, size) against [decode/newapp].
+ *
+ * return: offset to continue from, a multiple of both the erase block of [decode/newapp] and the chunk.
+ */
+static uint32_t emboot_ckp_scan(const struct fal_partition *part, uint32_t hash, uint32_t size)
+{
+    uint32_t from = 0;
+    uint32_t head = EMBOOT_CRC_INIT;
+    uint32_t blks = emboot_lazy_blks(part);
+    uint32_t unit = blks > EMBOOT_CKP_CHUNK ? blks : EMBOOT_CKP_CHUNK; // both are powers of two
+    uint32_t data;
+
+    if (emboot_rec_get(EMBOOT_CKP_ADDR, 0, &data) < 0 || data != hash || emboot_rec_get(EMBOOT_CKP_ADDR, 1, &data) < 0 || data != size)
+    {
+        return 0;                                           // the log of another image
+    }
+
+    for (uint32_t index = 0; index < EMBOOT_CKP_NUMS && from + EMBOOT_CKP_CHUNK <= part->len && from + EMBOOT_CKP_CHUNK <= emboot_ckp_limit; ++index)
+    {
+        if (emboot_rec_get(EMBOOT_CKP_ADDR, EMBOOT_CKP_HEAD + index, &data) < 0 || emboot_ckp_chunk(part, from) != data)
+        {
+            break;
+        }
+        from += EMBOOT_CKP_CHUNK;
+
+        head = embcrc_combine(head, data, EMBOOT_CKP_CHUNK);
+        if (from % unit == 0)
+        {
+            emboot_ckp_head = head;
+            emboot_ckp_head_size = from;
+        }
+    }
+
+    return from / unit * unit;
+}
+
+/**
+ * starts the log of a decode: every record is written once, so the log is erased and takes the image (hash, size)
+ * and the chunks below the resume point again, read back from [decode/newapp]. the decode logs the ones above it.
+ *
+ * return: offset to continue from.
+ */
+static uint32_t emboot_ckp_start(uint32_t hash, uint32_t size)
+{
+    const struct fal_partition *part = emboot_part(EMBOOT_NEWAPP_ID);
+    uint32_t from = EMBOOT_CKP_SIZE ? emboot_ckp_scan(part, hash, size) : 0;
+    emboot_ckp_limit = 0xFFFFFFFF;
+    if (EMBOOT_CKP_SIZE == 0)
+    {
+        return 0;
+    }
+
+    emboot_ckp_erase();
+    emboot_rec_set(EMBOOT_CKP_ADDR, 0, hash);
+    emboot_rec_set(EMBOOT_CKP_ADDR, 1, size);
+    for (uint32_t index = 0; index < from / EMBOOT_CKP_CHUNK; ++index)
+    {
+        emboot_rec_set(EMBOOT_CKP_ADDR, EMBOOT_CKP_HEAD + index, emboot_ckp_chunk(part, index * EMBOOT_CKP_CHUNK));
+        emboot_slice(EMBOOT_CKP_CHUNK);
+    }
+    return from;
+}
+
+/**
+ * logs every chunk once its last byte is programmed, the decoder writes in pieces of any size.
+ */
+static void emboot_ckp_feed(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    while (size > 0)
+    {
+        uint32_t len = EMBOOT_CKP_CHUNK - addr % EMBOOT_CKP_CHUNK;
+        len = len > size ? size : len;
+
+        if (addr % EMBOOT_CKP_CHUNK == 0)
+        {
+            emboot_ckp_hash = EMBOOT_CRC_INIT;
+        }
+        emboot_ckp_hash = embcrc(data, len, emboot_ckp_hash);
+
+        addr += len;
+        data += len;
+        size -= len;
+
+        uint32_t index = addr / EMBOOT_CKP_CHUNK - 1;
+        if (addr % EMBOOT_CKP_CHUNK == 0 && addr > emboot_ckp_from && index < EMBOOT_CKP_NUMS)
+        {
+            emboot_rec_set(EMBOOT_CKP_ADDR, EMBOOT_CKP_HEAD + index, emboot_ckp_hash);
+        }
+    }
+}
+
+static int emboot_decode_write_ckp(unsigned int addr, unsigned char *data, unsigned int size)
+{
+    uint32_t skip = addr >= emboot_ckp_from ? 0 : emboot_ckp_from - addr;
+    skip = skip > size ? size : skip;
+
+    if (size > skip && emboot_lazy_write(&emboot_decode_lazy, addr + skip, data + skip, size - skip) < 0)
+    {
+        return -1;
+    }
+    if (EMBOOT_CKP_SIZE)
+    {
+        emboot_ckp_feed(addr, data, size);
+    }
+    return size;
+}
+
+/**
+ * return: size without the trailing erased (0xFF) space, rounded up to 32 bytes.
+ * a trailing 0xFF of the image itself is cut off too, which is harmless as it equals the erased state.
+ */
+static int emboot_used_size(int size, emboot_get_t embget)
+{
+#if EMBOOT_TRIM
+    int end = size;
+    while (end > 0)
+    {
+        int len = end > (int)sizeof(emboot_copy_buffer) ? (int)sizeof(emboot_copy_buffer) : end;
+        embget(end - len, emboot_copy_buffer, len);
+
+        int pos = len;
+        while (pos > 0 && emboot_copy_buffer[pos - 1] == 0xFF)
+        {
+            pos--;
+        }
+        if (pos > 0)
+        {
+            end = end - len + pos;
+            break;
+        }
+        end -= len;
+        emboot_slice(len);
+    }
+    end = (end + 31) & ~31;
+    return end < size ? end : size;
+#else
+    return size;
+#endif
+}
+
+/**
+ * erases the partition from its start up to size, or up to its used size if that is larger, so that
+ * everything behind the data to be written is erased as well.
+ */
+static int emboot_erase_used(emboot_part_t id, int size, emboot_get_t embget)
+{
+    const struct fal_partition *part = emboot_part(id);
+    if (part == RT_NULL)
+    {
+        return -1;
+    }
+
+#if EMBOOT_TRIM
+    int used = emboot_used_size(part->len, embget);
+    uint32_t blks = emboot_lazy_blks(part);
+    uint32_t end = used > size ? used : size;
+    end = (end + blks - 1) / blks * blks;
+    if (end > part->len)
+    {
+        end = part->len;
+    }
+    emboot_printf_d("(erase size = 0x%08X) ", end);
+    return emboot_part_erase_slice(part, 0, end);
+#else
+    return emboot_part_erase_all(part);
+#endif
+}
+
+/**
+ * erases what an earlier image left above the erased area, once the new one is complete. the used size of the
+ * partition (emboot_used_size, as taken by a forced recopy) is then the size of the new image.
+ */
+static int emboot_lazy_fini(emboot_lazy_t *lazy, emboot_get_t embget)
+{
+#if EMBOOT_LAZY_ERASE
+    uint32_t used = emboot_used_size(lazy->part->len, embget);
+    for (uint32_t len; lazy->erased < used; lazy->erased += len)
+    {
+        len = lazy->part->len - lazy->erased < lazy->blks ? lazy->part->len - lazy->erased : lazy->blks;
+        if (emboot_part_erase(lazy->part, lazy->erased, len) < 0)
+        {
+            return -1;
+        }
+        emboot_slice(len);
+    }
+#endif
+    return 0;
+}
+
+int emboot_runapp_erase_used(int size) { return emboot_erase_used(emboot_part_runapp, size, emboot_runapp_read); }
+int emboot_backup_erase_used(int size) { return emboot_erase_used(emboot_part_backup, size, emboot_backup_read); }
+
+static uint32_t emboot_sync_skipped;                        // sectors found identical, since boot
+static uint32_t emboot_sync_rewritten;
+
+void embget_sync_stat(uint32_t *skipped, uint32_t *rewritten)
+{
+    *skipped = emboot_sync_skipped;
+    *rewritten = emboot_sync_rewritten;
+}
+
+#if EMBOOT_SKIP_SAME
+/**
+ * copies remain bytes from embget to [curent/runapp], sector by sector: a sector is only erased and programmed
+ * if it differs from the source. sectors behind the data are brought to the erased state the same way.
+ * the source is hashed on the way.
+ *
+ * return: offset of the first mismatching byte after programming, or -1 if the copy is good.
+ */
+static int emboot_sync_data(int remain, emboot_get_t embget, uint32_t *hash)
+{
+    const struct fal_partition *part = emboot_part(emboot_part_runapp);
+    int blkmax = sizeof(emboot_copy_buffer);
+    uint32_t skipped = 0;
+    uint32_t rewritten = 0;
+
+    if (part == RT_NULL)
+    {
+        return 0;
+    }
+
+    uint32_t blks = emboot_lazy_blks(part);
+    int used = emboot_used_size(part->len, emboot_runapp_read);
+    int end = (remain > used ? remain : used);
+    end = (end + blks - 1) / blks * blks;
+    end = end < part->len ? end : part->len;
+
+    const struct fal_partition *src = emboot_get_part(embget);
+    const uint8_t *src_map = emboot_part_map(src);
+    const uint8_t *dst_map = emboot_part_map(part);
+    const uint8_t *data;
+    const uint8_t *back;
+    emboot_hash_begin();
+
+    emboot_printf_i("00%%");
+    for (int sec = 0; sec < end; sec += blks)
+    {
+        int percent = sec * 100 / end;
+        if (percent % 5 == 0)
+        {
+            emboot_printf_i("\b\b\b%02d%%", percent);
+        }
+        emboot_slice(blks);
+
+        // compare, the source reads as erased behind remain.
+        int same = 1;
+        for (int pos = sec; pos < sec + blks; pos += blkmax)
+        {
+            int blklen = blkmax < sec + blks - pos ? blkmax : sec + blks - pos;
+            int srclen = pos >= remain ? 0 : (remain - pos < blklen ? remain - pos : blklen);
+            if (srclen == 0 || emboot_blank_run(src, pos, srclen) == srclen)
+            {
+                if (srclen)
+                {
+                    emboot_hash_blank(srclen);
+                }
+                if (same && emboot_blank_run(part, pos, blklen) == blklen)
+                {
+                    continue;                               // erased on both sides
+                }
+                srclen = 0;
+            }
+            else
+            {
+                data = emboot_get_data(src_map, embget, pos, emboot_copy_buffer, srclen);
+                emboot_hash_data(data, srclen);
+            }
+            if (same)
+            {
+                back = emboot_get_data(dst_map, emboot_runapp_read, pos, emboot_back_buffer, blklen);
+                same = srclen == 0 || emboot_diff(data, back, srclen) == srclen;
+                for (int i = srclen; same && i < blklen; ++i)
+                {
+                    same = back[i] == 0xFF;
+                }
+            }
+        }
+        if (same)
+        {
+            skipped++;
+            continue;
+        }
+
+        rewritten++;
+        emboot_part_erase(part, sec, blks);
+        for (int pos = sec; pos < sec + blks && pos < remain; pos += blkmax)
+        {
+            int blklen = remain - pos < blkmax ? remain - pos : blkmax;
+            blklen = blklen < sec + blks - pos ? blklen : sec + blks - pos;
+            if (emboot_blank_run(src, pos, blklen) == blklen)
+            {
+                continue;                                   // the sector was just erased
+            }
+            data = emboot_get_data(src_map, embget, pos, emboot_copy_buffer, blklen);
+            emboot_runapp_write(pos, (unsigned char *)data, blklen);
+#if EMBOOT_COPY_VERIFY
+            int i = emboot_diff(data, emboot_get_data(dst_map, emboot_runapp_read, pos, emboot_back_buffer, blklen), blklen);
+            if (i < blklen)
+            {
+                emboot_printf_i("\b\b\b%02d%% ", percent);
+                emboot_printf_d("(mismatch at 0x%08X) ", pos + i);
+                emboot_sync_skipped += skipped;
+                emboot_sync_rewritten += rewritten;
+                return pos + i;
+            }
+#endif
+        }
+    }
+    emboot_printf_i("\b\b\b100%% ");
+    emboot_printf_d("(copied size = 0x%08X, sectors skipped = %d, rewritten = %d) ", remain, skipped, rewritten);
+
+    emboot_sync_skipped += skipped;
+    emboot_sync_rewritten += rewritten;
+    *hash = emboot_hash_value();
+
+    return -1;
+}
+#endif
+
+/**
+ * block manifest of the package (see emboot_head_t): the crc of every block of the new image.
+ *
+ * return: the manifest if it describes the image of size and hash (the blocks must add up to hash), else RT_NULL.
+ */
+static const uint32_t *emboot_manifest(emboot_head_t *emboot_head, uint32_t size, uint32_t hash)
+{
+    uint32_t blk = emboot_head->Reserved_C1;
+    uint32_t off = emboot_head->Reserved_C2;
+    uint32_t num = emboot_head->Reserved_C3;
+
+    if (blk == 0 || blk == 0xFFFFFFFF || (blk & (blk - 1)) != 0 || size == 0 || size == 0xFFFFFFFF ||
+        num != (size - 1) / blk + 1 || off % 4 != 0 ||
+        emboot_head->header_size > sizeof(emboot_head_buffer) || emboot_head->patchx_nums > EMBOOT_PATCHX_MAX ||
+        off < sizeof(emboot_head_t) + emboot_head->patchx_nums * sizeof(patchi_data_t) ||
+        off > emboot_head->header_size || (emboot_head->header_size - off) / 4 < num)
+    {
+        return RT_NULL;
+    }
+
+    const uint32_t *crc = (const uint32_t *)((uint8_t *)emboot_head + off);
+    uint32_t all = EMBOOT_CRC_INIT;
+    for (uint32_t i = 0; i < num; ++i)
+    {
+        all = embcrc_combine(all, crc[i], i + 1 < num ? blk : size - i * blk);
+    }
+    return all == hash ? crc : RT_NULL;
+}
+
+/**
+ * checks the image read by embget block by block, from the block at offset from on. stops at the first bad block.
+ *
+ * return: offset of the first bad block, or -1 if the image is good.
+ */
+static int emboot_manifest_check(emboot_head_t *emboot_head, const uint32_t *crc, uint32_t from, uint32_t size, emboot_get_t embget)
+{
+    const struct fal_partition *part = emboot_get_part(embget);
+    const uint8_t *map = emboot_part_map(part);
+    uint32_t blk = emboot_head->Reserved_C1;
+    uint32_t len;
+
+    emboot_printf_i("00%%");
+    for (uint32_t pos = from / blk * blk; pos < size; pos += blk)
+    {
+        int percent = (uint64_t)pos * 100 / size;
+        if (percent % 5 == 0)
+        {
+            emboot_printf_i("\b\b\b%02d%%", percent);
+        }
+
+        uint32_t end = size - pos > blk ? pos + blk : size;
+        emboot_hash_begin();
+        for (uint32_t at = pos; at < end; at += len)
+        {
+            if ((len = emboot_blank_run(part, at, end - at)) > 0)
+            {
+                emboot_hash_blank(len);
+            }
+            else
+            {
+                len = end - at > sizeof(emboot_copy_buffer) ? sizeof(emboot_copy_buffer) : end - at;
+                emboot_hash_data(emboot_get_data(map, embget, at, emboot_copy_buffer, len), len);
+            }
+        }
+        if (emboot_hash_value() != crc[pos / blk])
+        {
+            emboot_printf_i("\b\b\b%02d%% ", percent);
+            emboot_printf_d("(bad block at 0x%08X) ", pos);
+            return pos;
+        }
+        emboot_slice(end - pos);
+    }
+    emboot_printf_i("\b\b\b100%% ");
+
+    return -1;
+}
+
+/**
+ * rewrites the bad blocks of [curent/runapp] from embget, from the block at offset from on: the erase sectors under
+ * a bad block are erased and programmed again, and the check goes on from the first of them.
+ *
+ * return: offset of a block that is still bad after its rewrite, or -1 if the image is good.
+ */
+static int emboot_manifest_mend(emboot_head_t *emboot_head, const uint32_t *crc, uint32_t from, uint32_t size, emboot_get_t embget)
+{
+    const struct fal_partition *part = emboot_part(emboot_part_runapp);
+    uint32_t blk = emboot_head->Reserved_C1;
+    int last = -1;
+    int bad;
+
+    if (part == RT_NULL)
+    {
+        return from;
+    }
+    uint32_t blks = emboot_lazy_blks(part);
+    const uint8_t *map = emboot_part_map(emboot_get_part(embget));
+
+    while ((bad = emboot_manifest_check(emboot_head, crc, from, size, emboot_runapp_read)) >= 0)
+    {
+        if (bad <= last)
+        {
+            return bad;                                     // no progress, the rewrite did not help
+        }
+        last = bad;
+
+        uint32_t bgn = bad / blks * blks;
+        uint32_t end = (bad + blk + blks - 1) / blks * blks;
+        end = end < part->len ? end : part->len;
+        emboot_part_erase(part, bgn, end - bgn);
+        for (uint32_t pos = bgn, len; pos < end && pos < size; pos += len)
+        {
+            len = size - pos > sizeof(emboot_copy_buffer) ? sizeof(emboot_copy_buffer) : size - pos;
+            len = len < end - pos ? len : end - pos;
+            emboot_runapp_write(pos, (unsigned char *)emboot_get_data(map, embget, pos, emboot_copy_buffer, len), len);
+            emboot_slice(len);
+        }
+        emboot_printf_d("(rewritten 0x%08X..0x%08X) ", bgn, end);
+        from = bgn;
+    }
+
+    return -1;
+}
+
+int embget_runapp_size(void)
+{
+    const struct fal_partition *part = emboot_part(emboot_part_runapp);
+    if (part == RT_NULL)
+    {
+        return 0;
+    }
+    return part->len;
+}
+
+int embget_runapp_data(void)
+{
+    int data;
+    emboot_oldapp_read(0, (uint8_t *)&data, sizeof(data));
+    return data;
+}
+
+/**
+ * control block journal at [upctrl:EMBOOT_JNL_ADDR]: sectors of EMBOOT_JNL_SECT bytes, each filled with emboot_jrec_t
+ * from its start. the active sector is the one whose first record has the highest sequence number. once it is full,
+ * the next sector (the oldest) is erased and starts with the new record, so the sectors wear in turn and the last
+ * good record is never erased before a newer one is programmed. a record torn by a power cut fails its crc.
+ */
+#define EMBOOT_JNL_RECS                 (EMBOOT_JNL_SECT / sizeof(emboot_jrec_t))
+#define EMBOOT_JNL_FREE                 0xFFFFFFFF
+
+static uint32_t emboot_jnl_seq;                             // sequence number of the last record
+static uint32_t emboot_jnl_next;                            // offset of the next slot in the journal
+
+static const emboot_jrec_t *emboot_jnl_rec(const uint8_t *map, uint32_t addr, emboot_jrec_t *buf)
+{
+    return (const emboot_jrec_t *)emboot_get_data(map, emboot_upctrl_read, EMBOOT_JNL_ADDR + addr, (uint8_t *)buf, sizeof(emboot_jrec_t));
+}
+
+static uint32_t emboot_jnl_step(uint32_t addr)
+{
+    addr += sizeof(emboot_jrec_t);
+    if (addr % EMBOOT_JNL_SECT > EMBOOT_JNL_SECT - sizeof(emboot_jrec_t))
+    {
+        addr += EMBOOT_JNL_SECT - addr % EMBOOT_JNL_SECT;   // records do not cross a sector
+    }
+    return addr % EMBOOT_JNL_SIZE;
+}
+
+static int emboot_jnl_good(const emboot_jrec_t *rec)
+{
+    return rec->seq != EMBOOT_JNL_FREE && rec->crc == embcrc((const uint8_t *)rec, offsetof(emboot_jrec_t, crc), EMBOOT_CRC_INIT);
+}
+
+static int emboot_jnl_blank(const emboot_jrec_t *rec)
+{
+    const uint32_t *word = (const uint32_t *)rec;
+    for (int i = 0; i < sizeof(emboot_jrec_t) / sizeof(uint32_t); ++i)
+    {
+        if (word[i] != 0xFFFFFFFF)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * finds the last good record: the first record of every sector, then a binary search for the last programmed slot
+ * of the active one. *next is set to the slot behind it.
+ *
+ * return: the record (in the mapping, else in buf), RT_NULL if the journal has none.
+ */
+static const emboot_jrec_t *emboot_jnl_find(const uint8_t *map, emboot_jrec_t *buf, uint32_t *next)
+{
+    uint32_t sec = EMBOOT_JNL_SIZE;
+    uint32_t seq = 0;
+    for (uint32_t addr = 0; addr < EMBOOT_JNL_SIZE; addr += EMBOOT_JNL_SECT)
+    {
+        const emboot_jrec_t *rec = emboot_jnl_rec(map, addr, buf);
+        if (emboot_jnl_good(rec) && (sec == EMBOOT_JNL_SIZE || rec->seq > seq))
+        {
+            sec = addr;
+            seq = rec->seq;
+        }
+    }
+
+    *next = 0;
+    if (sec == EMBOOT_JNL_SIZE)
+    {
+        return RT_NULL;
+    }
+
+    uint32_t lo = 0;
+    uint32_t hi = EMBOOT_JNL_RECS - 1;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi + 1) / 2;
+        if (emboot_jnl_rec(map, sec + mid * sizeof(emboot_jrec_t), buf)->seq != EMBOOT_JNL_FREE)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    *next = emboot_jnl_step(sec + lo * sizeof(emboot_jrec_t));
+
+    const emboot_jrec_t *rec;
+    while (!emboot_jnl_good(rec = emboot_jnl_rec(map, sec + lo * sizeof(emboot_jrec_t), buf)))
+    {
+        lo--;                                               // torn, the first record of the sector is good
+    }
+    return rec;
+}
+
+static int emboot_jnl_append(const emboot_ctrl_t *ctrl)
+{
+    const struct fal_partition *part = emboot_part(emboot_part_upctrl);
+    const uint8_t *map = emboot_part_map(part);
+    emboot_jrec_t rec, buf;
+    rec.seq = emboot_jnl_seq + 1;
+    rec.ctrl = *ctrl;
+    rec.rsvd = 0xFFFFFFFF;
+    rec.crc = embcrc((const uint8_t *)&rec, offsetof(emboot_jrec_t, crc), EMBOOT_CRC_INIT);
+
+    for (int trys = 0; trys < EMBOOT_JNL_RECS; ++trys)
+    {
+        uint32_t addr = emboot_jnl_next;
+        emboot_jnl_next = emboot_jnl_step(addr);
+        if (addr % EMBOOT_JNL_SECT == 0)
+        {
+            emboot_part_erase(part, EMBOOT_JNL_ADDR + addr, EMBOOT_JNL_SECT);
+        }
+
+        const emboot_jrec_t *slot = emboot_jnl_rec(map, addr, &buf);
+        if (emboot_jnl_blank(slot))
+        {
+            emboot_upctrl_write(EMBOOT_JNL_ADDR + addr, (uint8_t *)&rec, sizeof(rec));
+            slot = emboot_jnl_rec(map, addr, &buf);
+            if (memcmp(slot, &rec, sizeof(rec)) == 0)
+            {
+                emboot_jnl_seq = rec.seq;
+                return 0;
+            }
+        }
+
+        // a bad slot is not programmed again (that would break the write granularity and the ecc of the flash), the
+        // record goes to the start of a freshly erased sector: this one if the bad slot starts it, else the next one.
+        emboot_jnl_next = addr / EMBOOT_JNL_SECT * EMBOOT_JNL_SECT;
+        if (addr % EMBOOT_JNL_SECT != 0)
+        {
+            emboot_jnl_next = (emboot_jnl_next + EMBOOT_JNL_SECT) % EMBOOT_JNL_SIZE;
+        }
+    }
+    return -1;
+}
+
+/**
+ * a request programmed in place at [upctrl:0] (the layout before the journal, still used by applications). it is
+ * imported into the journal by emboot_ctrl_load and erased then.
+ *
+ * return: the request (in the mapping, else in buf), RT_NULL if there is none.
+ */
+static const emboot_ctrl_t *emboot_ctrl_inplace(const uint8_t *map, emboot_ctrl_t *buf)
+{
+    const uint32_t *word = (const uint32_t *)emboot_get_data(map, emboot_upctrl_read, 0, (uint8_t *)buf, sizeof(emboot_ctrl_t));
+    for (int i = 0; i < sizeof(emboot_ctrl_t) / sizeof(uint32_t); ++i)
+    {
+        if (word[i] != 0xFFFFFFFF)
+        {
+            return (const emboot_ctrl_t *)word;
+        }
+    }
+    return RT_NULL;
+}
+
+/**
+ * applies a request to the journaled control block: an application sets only the fields it asks for and leaves the
+ * others erased, so its 0xFFFFFFFF words keep the journaled state (backup/decode info, the active slot...).
+ */
+static void emboot_ctrl_merge(emboot_ctrl_t *ctrl, const emboot_ctrl_t *req)
+{
+    uint32_t *dst = (uint32_t *)ctrl;
+    const uint32_t *src = (const uint32_t *)req;
+    for (int i = 0; i < sizeof(emboot_ctrl_t) / sizeof(uint32_t); ++i)
+    {
+        if (src[i] != 0xFFFFFFFF)
+        {
+            dst[i] = src[i];
+        }
+    }
+}
+
+/**
+ * erases the request at [upctrl:0], the emboot header at [upctrl:EMBOOT_MOV_ADDR] is written back if it shares the
+ * erase block (emboot_head_buffer is free, this runs before the first update step).
+ */
+static int emboot_ctrl_inplace_erase(void)
+{
+    const struct fal_partition *part = emboot_part(emboot_part_upctrl);
+    uint32_t blks = emboot_lazy_blks(part);
+    uint32_t size = (sizeof(emboot_ctrl_t) + blks - 1) / blks * blks;
+    uint32_t head = 0;
+    if (EMBOOT_MOV_ADDR < size)
+    {
+        emboot_upctrl_read(EMBOOT_MOV_ADDR, emboot_head_buffer, sizeof(head));
+        head = *(uint32_t *)emboot_head_buffer;
+        head = head <= sizeof(emboot_head_buffer) && head <= size - EMBOOT_MOV_ADDR ? head : 0;
+        emboot_upctrl_read(EMBOOT_MOV_ADDR, emboot_head_buffer, head);
+    }
+    if (emboot_part_erase(part, 0, size) < 0)
+    {
+        return -1;
+    }
+    return head == 0 || emboot_upctrl_write(EMBOOT_MOV_ADDR, emboot_head_buffer, head) >= 0 ? 0 : -1;
+}
+
+const emboot_ctrl_t *emboot_ctrl_map(void)
+{
+    static emboot_ctrl_t merged;                            // journaled state with a pending request applied
+    emboot_jrec_t buf;
+    uint32_t next;
+    const emboot_jrec_t *rec = emboot_jnl_find((const uint8_t *)__update_zone_addr, &buf, &next);
+    const emboot_ctrl_t *req = emboot_ctrl_inplace((const uint8_t *)__update_zone_addr, RT_NULL);
+    if (req)
+    {
+        if (rec)
+        {
+            merged = rec->ctrl;
+        }
+        else
+        {
+            memset(&merged, 0xFF, sizeof(emboot_ctrl_t));
+        }
+        emboot_ctrl_merge(&merged, req);
+        return &merged;
+    }
+    return rec ? &rec->ctrl : RT_NULL;
+}
+
+/**
+ * ram shadow of the journaled emboot_ctrl_t: looked up once, the getters read the shadow. the setters change the
+ * shadow inside a transaction, and the outermost emboot_ctrl_commit appends all the changes as one record.
+ */
+static int emboot_ctrl_depth;                               // open transactions
+static int emboot_ctrl_erase;                               // erase requested by the transaction
+
+static const emboot_ctrl_t *emboot_ctrl_load(void)
+{
+    if (!emboot_ctrl_loaded)
+    {
+        emboot_jrec_t buf;
+        const emboot_jrec_t *rec = emboot_jnl_find(emboot_part_map(emboot_part(emboot_part_upctrl)), &buf, &emboot_jnl_next);
+        memset(&emboot_ctrl_rom, 0xFF, sizeof(emboot_ctrl_t));
+        emboot_jnl_seq = 0;
+        if (rec)
+        {
+            emboot_ctrl_rom = rec->ctrl;
+            emboot_jnl_seq = rec->seq;
+        }
+        emboot_ctrl_ram = emboot_ctrl_rom;
+        emboot_ctrl_loaded = 1;
+
+        // an in-place request is journaled before it is erased, a power cut in between imports it again.
+        emboot_ctrl_t ctrl;
+        const emboot_ctrl_t *req = emboot_ctrl_inplace(emboot_part_map(emboot_part(emboot_part_upctrl)), &ctrl);
+        if (req)
+        {
+            emboot_ctrl_merge(&emboot_ctrl_ram, req);
+            if (emboot_jnl_append(&emboot_ctrl_ram) == 0)
+            {
+                emboot_ctrl_rom = emboot_ctrl_ram;
+                emboot_ctrl_inplace_erase();
+            }
+        }
+    }
+    return &emboot_ctrl_ram;
+}
+
+/**
+ * drops the shadow, the next access reads [upctrl] again (after it was changed behind emboot's back).
+ */
+void emboot_ctrl_drop(void)
+{
+    emboot_ctrl_loaded = 0;
+    emboot_ctrl_depth = 0;
+    emboot_ctrl_erase = 0;
+#if EMBOOT_SWAP_MODE
+    emboot_swap_halt = 0;                                   // as after a reset
+#endif
+}
+
+emboot_ctrl_t *emboot_ctrl_begin(void)
+{
+    emboot_ctrl_load();
+    emboot_ctrl_depth++;
+    return &emboot_ctrl_ram;
+}
+
+int emboot_ctrl_commit(void)
+{
+    if (emboot_ctrl_depth > 0 && --emboot_ctrl_depth > 0)
+    {
+        return 0;
+    }
+
+#if EMBOOT_SWAP_MODE
+    if (emboot_ctrl_erase)
+    {
+        emboot_part_erase_slice(emboot_part(emboot_part_upctrl), EMBOOT_SWP_ADDR, EMBOOT_SWP_SIZE); // a requested swap starts from an empty log.
+    }
+#endif
+    emboot_ctrl_erase = 0;
+
+    if (memcmp(&emboot_ctrl_ram, &emboot_ctrl_rom, sizeof(emboot_ctrl_t)) == 0)
+    {
+        return 0;
+    }
+    if (emboot_jnl_append(&emboot_ctrl_ram) < 0)
+    {
+        return -1;
+    }
+    emboot_ctrl_rom = emboot_ctrl_ram;
+    return 0;
+}
+
+int embset_update_step(emboot_step_t step, int erase)
+{
+    emboot_ctrl_begin()->update_step = step;
+    emboot_ctrl_erase |= erase;
+    return emboot_ctrl_commit();
+}
+
+int embget_update_step(void)
+{
+    return emboot_ctrl_load()->update_step;
+}
+
+int embset_update_stay(int stay)
+{
+    emboot_ctrl_begin()->update_stay = stay;
+    return emboot_ctrl_commit();
+}
+
+int embget_update_stay(void)
+{
+    int stay = (int)emboot_ctrl_load()->update_stay;
+    stay = stay != -1 && stay != 0;
+    if (stay)
+    {
+        embset_update_stay(0);
+    }
+    return stay;
+}
+
+int embset_patchi_indx(int index)
+{
+    emboot_ctrl_begin()->patchi_indx = index;
+    return emboot_ctrl_commit();
+}
+
+int embget_patchi_indx(void)
+{
+    return emboot_ctrl_load()->patchi_indx;
+}
+
+int embset_backup_info(uint32_t size, uint32_t hash)
+{
+    emboot_ctrl_t *emboot_ctrl = emboot_ctrl_begin();
+    emboot_ctrl->backup_size = size;
+    emboot_ctrl->backup_hash = hash;
+    return emboot_ctrl_commit();
+}
+
+int embset_decode_info(uint32_t size, uint32_t hash)
+{
+    emboot_ctrl_t *emboot_ctrl = emboot_ctrl_begin();
+    emboot_ctrl->decode_size = size;
+    emboot_ctrl->decode_hash = hash;
+    return emboot_ctrl_commit();
+}
+
+#if EMBOOT_AB_SLOT
+static int emboot_slot_of(uint32_t flip)
+{
+    int slot = 0;
+    for (; flip != 0xFFFFFFFF; flip |= flip + 1)
+    {
+        slot ^= 1;
+    }
+    return slot;
+}
+
+int embget_boot_slot(void)
+{
+    return emboot_slot_of(emboot_ctrl_load()->slot_flip);
+}
+
+/**
+ * every switch clears one more bit of slot_flip, once it runs out of bits the counter restarts.
+ */
+int embset_boot_slot(int slot)
+{
+    emboot_ctrl_t *emboot_ctrl = emboot_ctrl_begin();
+    if (emboot_slot_of(emboot_ctrl->slot_flip) != slot)
+    {
+        if (emboot_ctrl->slot_flip != 0)
+        {
+            emboot_ctrl->slot_flip &= emboot_ctrl->slot_flip - 1;
+        }
+        else
+        {
+            emboot_ctrl->slot_flip = slot ? 0xFFFFFFFE : 0xFFFFFFFF;
+        }
+    }
+    emboot_slot = slot;
+    return emboot_ctrl_commit();
+}
+
+int embset_slot_info(int slot, uint32_t size, uint32_t hash)
+{
+    emboot_ctrl_t *emboot_ctrl = emboot_ctrl_begin();
+    emboot_ctrl->slot_size[slot] = size;
+    emboot_ctrl->slot_hash[slot] = hash;
+    return emboot_ctrl_commit();
+}
+#endif
+
+/**
+ * clears [upctrl] for a new package: the logs and the header are erased, the journal gets a blank control block.
+ * in A/B slot mode the active slot and its image info are kept.
+ */
+int emboot_upctrl_reset(void)
+{
+    emboot_ctrl_t *reset = emboot_ctrl_begin();
+#if EMBOOT_AB_SLOT
+    emboot_ctrl_t emboot_ctrl = *reset;
+    int slot = emboot_slot_of(emboot_ctrl.slot_flip);
+    memset(reset, 0xFF, sizeof(emboot_ctrl_t));
+    reset->slot_flip = emboot_ctrl.slot_flip;
+    reset->slot_size[slot] = emboot_ctrl.slot_size[slot];
+    reset->slot_hash[slot] = emboot_ctrl.slot_hash[slot];
+#else
+    memset(reset, 0xFF, sizeof(emboot_ctrl_t));
+#endif
+    emboot_upctrl_erase();
+    return emboot_ctrl_commit();
+}
+
+int embset_verify_info(uint32_t size, uint32_t hash)
+{
+    emboot_ctrl_t *emboot_ctrl = emboot_ctrl_begin();
+    emboot_ctrl->verify_size = size;
+    emboot_ctrl->verify_hash = hash;
+    emboot_ctrl->verify_mark = size ? embcrc((uint8_t *)&emboot_ctrl->verify_size, 8, EMBOOT_CRC_INIT) : 0;
+    return emboot_ctrl_commit();
+}
+
+/**
+ * the token is valid if it was written for exactly this package (header + remain).
+ */
+static int embget_verify_info(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
+{
+    return emboot_ctrl->verify_size != 0x00000000 &&
+           emboot_ctrl->verify_size != 0xFFFFFFFF &&
+           emboot_ctrl->verify_size == emboot_head->header_size + emboot_head->remain_size &&
+           emboot_ctrl->verify_hash == emboot_head->remain_hash &&
+           emboot_ctrl->verify_mark == embcrc((uint8_t *)&emboot_ctrl->verify_size, 8, EMBOOT_CRC_INIT);
+}
+
+hpi_BOOL hpatch_stream_read_empty(struct hpatchi_listener_t *listener, hpi_pos_t addr, hpi_byte *data, hpi_size_t size)
+{
+    memset(data, 0, size);
+    return hpi_TRUE;
+}
+
+static emboot_read_stat_t emboot_read_stat;                 // since boot
+
+void embget_read_stat(emboot_read_stat_t *stat)
+{
+    *stat = emboot_read_stat;
+}
+
+#if EMBOOT_OLD_CACHE_SETS
+/**
+ * set-associative, least recently used way replaced. the old image does not change during a decode, so lines are
+ * only dropped when the decode (re)starts.
+ */
+typedef struct emboot_cache_t
+{
+    const struct fal_partition         *part;
+    uint32_t                            tick;
+    uint32_t                            line[EMBOOT_OLD_CACHE_SETS][EMBOOT_OLD_CACHE_WAYS]; // line number + 1, 0: empty
+    uint32_t                            used[EMBOOT_OLD_CACHE_SETS][EMBOOT_OLD_CACHE_WAYS];
+    uint8_t                             data[EMBOOT_OLD_CACHE_SETS][EMBOOT_OLD_CACHE_WAYS][EMBOOT_OLD_CACHE_LINE];
+} emboot_cache_t;
+
+static emboot_cache_t emboot_old_cache;
+
+static const uint8_t *emboot_cache_line(emboot_cache_t *cache, uint32_t line)
+{
+    uint32_t set = line % EMBOOT_OLD_CACHE_SETS;
+    int way = 0;
+
+    for (int i = 0; i < EMBOOT_OLD_CACHE_WAYS; ++i)
+    {
+        if (cache->line[set][i] == line + 1)
+        {
+            cache->used[set][i] = ++cache->tick;
+            emboot_read_stat.old_hits++;
+            return cache->data[set][i];
+        }
+        if (cache->used[set][i] < cache->used[set][way])
+        {
+            way = i;
+        }
+    }
+
+    uint32_t addr = line * EMBOOT_OLD_CACHE_LINE;
+    uint32_t size = cache->part->len - addr < EMBOOT_OLD_CACHE_LINE ? cache->part->len - addr : EMBOOT_OLD_CACHE_LINE;
+    if (emboot_part_read(cache->part, addr, cache->data[set][way], size) < 0)
+    {
+        cache->line[set][way] = 0;
+        return RT_NULL;
+    }
+    cache->line[set][way] = line + 1;
+    cache->used[set][way] = ++cache->tick;
+    emboot_read_stat.old_misses++;
+    return cache->data[set][way];
+}
+#endif
+
+/**
+ * patch stream read-ahead, the decoder reads it strictly forward in small pieces.
+ */
+#if EMBOOT_PATCH_AHEAD
+static uint8_t  emboot_ahead_buffer[EMBOOT_PATCH_AHEAD];
+#endif
+static uint32_t emboot_ahead_addr;
+static uint32_t emboot_ahead_size;
+static const struct fal_partition *emboot_ahead_part;
+static const uint8_t *emboot_ahead_map;
+
+static const struct fal_partition *emboot_old_part;
+static const uint8_t *emboot_old_map;                       // mapped old image, needs neither the cache nor a read
+
+/**
+ * the decoder hands out pieces of any size, they are collected to whole aligned buffers before programming.
+ */
+#if EMBOOT_NEW_BUFFER
+static uint8_t  emboot_new_buffer[EMBOOT_NEW_BUFFER];
+static uint32_t emboot_new_unit;                            // bytes programmed at once: whole write granules of [decode/newapp] that fit in the buffer
+#endif
+static uint32_t emboot_new_fill;
+
+static int hpatch_stream_init(void)
+{
+#if EMBOOT_OLD_CACHE_SETS
+    memset(emboot_old_cache.line, 0, sizeof(emboot_old_cache.line));
+    memset(emboot_old_cache.used, 0, sizeof(emboot_old_cache.used));
+    emboot_old_cache.tick = 0;
+    emboot_old_cache.part = emboot_part(EMBOOT_OLDAPP_ID);
+#endif
+    emboot_ahead_size = 0;
+    emboot_ahead_part = emboot_part(emboot_part_backup);
+    emboot_ahead_map = emboot_part_map(emboot_ahead_part);
+    emboot_old_part = emboot_part(EMBOOT_OLDAPP_ID);
+    emboot_old_map = emboot_part_map(emboot_old_part);
+
+    emboot_new_fill = 0;
+#if EMBOOT_NEW_BUFFER
+    const struct fal_flash_dev *flash = emboot_part_dev(emboot_part(EMBOOT_NEWAPP_ID));
+    uint32_t gran = (flash && flash->write_gran > 8) ? flash->write_gran / 8 : 1;
+    emboot_new_unit = EMBOOT_NEW_BUFFER / gran * gran;
+    if (emboot_new_unit == 0)
+    {
+        emboot_printf_e("EMBOOT_NEW_BUFFER is smaller than the write granularity of [decode/newapp] (%d bytes)!\n", gran);
+        return -1;
+    }
+    if (emboot_new_unit != EMBOOT_NEW_BUFFER)
+    {
+        emboot_printf_d("@DEBUG [EMBOOT_NEW_BUFFER cut down to %d bytes, the write granularity is %d bytes]\n", emboot_new_unit, gran);
+    }
+#endif
+    return 0;
+}
+
+hpi_BOOL hpatch_stream_read_old(struct hpatchi_listener_t *listener, hpi_pos_t addr, hpi_byte *data, hpi_size_t size)
+{
+    if (emboot_old_map)
+    {
+        if (addr > emboot_old_part->len || size > emboot_old_part->len - addr) { return hpi_FALSE; }
+        memcpy(data, emboot_old_map + addr, size);
+        return hpi_TRUE;
+    }
+#if EMBOOT_OLD_CACHE_SETS
+    if (size < EMBOOT_OLD_CACHE_LINE && emboot_old_cache.part)
+    {
+        if (addr > emboot_old_cache.part->len || size > emboot_old_cache.part->len - addr) { return hpi_FALSE; }
+        while (size > 0)
+        {
+            const uint8_t *line = emboot_cache_line(&emboot_old_cache, addr / EMBOOT_OLD_CACHE_LINE);
+            if (line == RT_NULL) { return hpi_FALSE; }
+
+            uint32_t len = EMBOOT_OLD_CACHE_LINE - addr % EMBOOT_OLD_CACHE_LINE;
+            len = len > size ? size : len;
+            memcpy(data, line + addr % EMBOOT_OLD_CACHE_LINE, len);
+            addr += len;
+            data += len;
+            size -= len;
+        }
+        return hpi_TRUE;
+    }
+#endif
+    emboot_read_stat.old_direct++;
+    int result = emboot_oldapp_read(addr, data, size);
+    if (result < 0) { return hpi_FALSE; }
+    return hpi_TRUE;
+}
+
+hpi_BOOL hpatch_stream_read_patch(hpi_TInputStreamHandle input_stream, hpi_byte *data, hpi_size_t *size)
+{
+    hpatch_handle_t *hpatch = (hpatch_handle_t *)input_stream;
+
+    if ((hpatch->patch_file_rd_pos + *size) > hpatch->patch_file_length)
+    {
+        *size = hpatch->patch_file_length - hpatch->patch_file_rd_pos;
+    }
+
+    uint32_t addr = hpatch->patch_file_offset + hpatch->patch_file_rd_pos;
+    uint32_t size_left = *size;
+    if (emboot_ahead_map)
+    {
+        if (addr > emboot_ahead_part->len || size_left > emboot_ahead_part->len - addr) { return hpi_FALSE; }
+        memcpy(data, emboot_ahead_map + addr, size_left);
+        hpatch->patch_file_rd_pos += *size;
+        return hpi_TRUE;
+    }
+#if EMBOOT_PATCH_AHEAD
+    if (size_left < EMBOOT_PATCH_AHEAD && emboot_ahead_part)
+    {
+        while (size_left > 0)
+        {
+            if (addr < emboot_ahead_addr || addr >= emboot_ahead_addr + emboot_ahead_size)
+            {
+                uint32_t end = hpatch->patch_file_offset + hpatch->patch_file_length;
+                emboot_ahead_addr = addr;
+                emboot_ahead_size = end - addr < EMBOOT_PATCH_AHEAD ? end - addr : EMBOOT_PATCH_AHEAD;
+                if (emboot_part_read(emboot_ahead_part, emboot_ahead_addr, emboot_ahead_buffer, emboot_ahead_size) < 0)
+                {
+                    emboot_ahead_size = 0;
+                    return hpi_FALSE;
+                }
+                emboot_read_stat.patch_fills++;
+            }
+            else
+            {
+                emboot_read_stat.patch_hits++;
+            }
+
+            uint32_t len = emboot_ahead_addr + emboot_ahead_size - addr;
+            len = len > size_left ? size_left : len;
+            memcpy(data, emboot_ahead_buffer + (addr - emboot_ahead_addr), len);
+            addr += len;
+            data += len;
+            size_left -= len;
+        }
+        hpatch->patch_file_rd_pos += *size;
+        return hpi_TRUE;
+    }
+#endif
+    emboot_read_stat.patch_direct++;
+    int result = emboot_backup_read(addr, data, size_left);
+    if (result < 0) { return hpi_FALSE; }
     hpatch->patch_file_rd_pos += *size;
     return hpi_TRUE;
 }
@@ -452,23 +2568,161 @@ hpi_BOOL hpatch_stream_write_new(struct hpatchi_listener_t *listener, const hpi_
 {
     hpatch_handle_t *hpatch = (hpatch_handle_t *)listener;
 
-    int percent = hpatch->newer_file_wr_pos * 100 / hpatch->newer_file_length;
-    if (percent % 5 == 0 && percent < 100)
+    if (hpatch->newer_file_wr_pos >= hpatch->newer_file_pc_pos)
     {
-        emboot_printf_i("\b\b\b%02d%%", percent);
+        int percent = hpatch->newer_file_wr_pos * 100 / hpatch->newer_file_length;
+        if (percent < 100)
+        {
+            emboot_printf_i("\b\b\b%02d%%", percent / 5 * 5);
+        }
+        hpatch->newer_file_pc_pos = ((percent / 5 + 1) * 5 * hpatch->newer_file_length + 99) / 100;
     }
 
-    int result = emboot_decode_write(hpatch->newer_file_wr_pos, (unsigned char *)data, size);
+#if !EMBOOT_DECODE_REREAD
+    emboot_hash->update(data, size);
+#endif
+    emboot_slice(size);
+
+#if EMBOOT_NEW_BUFFER
+    while (size > 0)
+    {
+        uint32_t addr = hpatch->newer_file_wr_pos - emboot_new_fill;
+        uint32_t len = emboot_new_unit - emboot_new_fill;
+        len = len > size ? size : len;
+
+        if (emboot_new_fill == 0 && len == emboot_new_unit)
+        {
+            if (emboot_decode_write_ckp(addr, (unsigned char *)data, len) < 0) { return hpi_FALSE; }
+        }
+        else
+        {
+            memcpy(emboot_new_buffer + emboot_new_fill, data, len);
+            emboot_new_fill += len;
+            if (emboot_new_fill == emboot_new_unit)
+            {
+                emboot_new_fill = 0;
+                if (emboot_decode_write_ckp(addr, emboot_new_buffer, emboot_new_unit) < 0) { return hpi_FALSE; }
+            }
+        }
+        hpatch->newer_file_wr_pos += len;
+        data += len;
+        size -= len;
+    }
+#else
+    int result = emboot_decode_write_ckp(hpatch->newer_file_wr_pos, (unsigned char *)data, size);
     if (result < 0) { return hpi_FALSE; }
     hpatch->newer_file_wr_pos += size;
+#endif
     return hpi_TRUE;
 }
 
+/**
+ * programs the last partial buffer, padded with 0xFF up to the write granularity.
+ */
+static int hpatch_stream_flush(hpatch_handle_t *hpatch)
+{
+#if EMBOOT_NEW_BUFFER
+    if (emboot_new_fill)
+    {
+        const struct fal_flash_dev *flash = emboot_part_dev(emboot_decode_lazy.part);
+        uint32_t gran = (flash && flash->write_gran > 8) ? flash->write_gran / 8 : 1;
+        uint32_t addr = hpatch->newer_file_wr_pos - emboot_new_fill;
+        uint32_t size = (emboot_new_fill + gran - 1) / gran * gran;
+        size = size > emboot_new_unit ? emboot_new_unit : size;
+
+        memset(emboot_new_buffer + emboot_new_fill, 0xFF, size - emboot_new_fill);
+        emboot_new_fill = 0;
+        return emboot_decode_write_ckp(addr, emboot_new_buffer, size);
+    }
+#endif
+    return 0;
+}
+
+/**
+ * header and remain hash of the package, calculated while it is being received.
+ */
+typedef struct embrym_hash_t
+{
+    uint32_t                            header_size;
+    uint32_t                            header_hash;
+    uint32_t                            remain_size;
+    uint32_t                            header_calc;
+    uint32_t                            remain_calc;        // latched from the hash engine, which the precheck starts over
+    uint32_t                            recved_size;
+    int                                 intact;             // every packet was read back from flash unchanged
+} embrym_hash_t;
+
+static embrym_hash_t embrym_hash;
+
+static void embrym_hash_init(void)
+{
+    memset(&embrym_hash, 0, sizeof(embrym_hash));
+    embrym_hash.intact = 1;
+}
+
+static void embrym_hash_feed(uint32_t pos, const uint8_t *data, uint32_t len)
+{
+    if (pos == 0 && len >= 16)
+    {
+        embrym_hash.header_size = ((uint32_t *)data)[0];
+        embrym_hash.header_hash = ((uint32_t *)data)[1];
+        embrym_hash.remain_size = ((uint32_t *)data)[2];
+        embrym_hash.header_calc = EMBOOT_CRC_INIT;
+        embrym_hash.remain_calc = EMBOOT_CRC_INIT;
+        emboot_hash->init();
+    }
+
+    if (pos != embrym_hash.recved_size || embrym_hash.header_size < 16 || embrym_hash.header_size > sizeof(emboot_head_buffer))
+    {
+        embrym_hash.intact = 0;
+        return;
+    }
+
+    uint32_t hbgn = 8;
+    uint32_t hend = embrym_hash.header_size;
+    uint32_t rbgn = embrym_hash.header_size;
+    uint32_t rend = embrym_hash.header_size + embrym_hash.remain_size;
+
+    if (pos < hend && pos + len > hbgn)
+    {
+        uint32_t bgn = pos > hbgn ? pos : hbgn;
+        uint32_t end = pos + len < hend ? pos + len : hend;
+        embrym_hash.header_calc = embcrc(data + bgn - pos, end - bgn, embrym_hash.header_calc);
+    }
+    if (pos < rend && pos + len > rbgn)
+    {
+        uint32_t bgn = pos > rbgn ? pos : rbgn;
+        uint32_t end = pos + len < rend ? pos + len : rend;
+        emboot_hash->update(data + bgn - pos, end - bgn);
+        embrym_hash.remain_calc = emboot_hash->final();
+    }
+
+    embrym_hash.recved_size = pos + len;
+}
+
+/**
+ * return: 1 if the received package matches the given header, and the flash holds exactly what was hashed.
+ */
+static int embrym_hash_done(emboot_head_t *emboot_head)
+{
+    return embrym_hash.intact &&
+           embrym_hash.header_size == emboot_head->header_size &&
+           embrym_hash.header_hash == emboot_head->header_hash &&
+           embrym_hash.remain_size == emboot_head->remain_size &&
+           embrym_hash.header_calc == emboot_head->header_hash &&
+           embrym_hash.recved_size >= emboot_head->header_size + emboot_head->remain_size &&
+           embrym_hash.remain_calc == emboot_head->remain_hash;
+}
+
 int emboot_verify_precheck(void)
 {
     emboot_head_t *emboot_head = (emboot_head_t *)emboot_head_buffer;
     int first8B = sizeof(emboot_head->header_size) + sizeof(emboot_head->header_hash);
 
+#if EMBOOT_AB_SLOT
+    emboot_slot = embget_boot_slot();
+#endif
+
     emboot_backup_read(0, (uint8_t *)emboot_head, first8B);
     emboot_printf_i("precheck package head: ");
     if (emboot_head->header_size > sizeof(emboot_head_buffer))
@@ -484,8 +2738,10 @@ int emboot_verify_precheck(void)
     }
     emboot_printf_i("ok!\n");
 
+    int hashed = embrym_hash_done(emboot_head);
+
     emboot_printf_i("precheck package body: ");
-    if (emboot_head->remain_hash != emboot_calc_hash(emboot_head->remain_size, emboot_head->header_size, emboot_backup_read))
+    if (!hashed && emboot_head->remain_hash != emboot_calc_hash(emboot_head->remain_size, emboot_head->header_size, emboot_backup_read))
     {
         emboot_printf_i("error hash!\n");
         return -1;
@@ -494,6 +2750,7 @@ int emboot_verify_precheck(void)
 
     int err = 0;
     int crc = 0;
+    int idx = 0;
 
     emboot_printf_i("\n");
     emboot_printf_i("verify\n");
@@ -501,7 +2758,7 @@ int emboot_verify_precheck(void)
 
 retry_precheck_dnload:
     emboot_printf_i("verify [dnload/backup] ");
-    if (emboot_head->remain_hash != (crc = emboot_calc_hash(emboot_head->remain_size, emboot_head->header_size, emboot_backup_read)))
+    if (!hashed && emboot_head->remain_hash != (crc = emboot_calc_hash(emboot_head->remain_size, emboot_head->header_size, emboot_backup_read)))
     {
         emboot_printf_i("error!\n");
         emboot_printf_d("@DEBUG [expect remain size = 0x%08X]\n", emboot_head->remain_size);
@@ -527,24 +2784,17 @@ retry_precheck_dnload:
     err = 0;
 
 retry_precheck_oldapp:
-    for (int i = 0; i < emboot_head->patchx_nums; ++i)
+    emboot_printf_i("verify [curent/runapp] ");
+    if ((idx = emboot_match_oldapp(emboot_head, emboot_oldapp_read)) >= 0)
     {
-        emboot_printf_i("verify [curent/runapp] ");
-        emboot_printf_i("%d/%d ", i+1, emboot_head->patchx_nums);
-
-        if (emboot_head->patchx_data[i].oldapp_size == 0x00000000 ||
-            emboot_head->patchx_data[i].oldapp_size == 0xFFFFFFFF ||
-            emboot_head->patchx_data[i].oldapp_hash == emboot_calc_hash(emboot_head->patchx_data[i].oldapp_size, 0, emboot_runapp_read))
-        {
-            emboot_printf_i("ok!\n");
-            emboot_printf_i("######\n");
-            emboot_printf_i("verify done!\n");
-            return 0;
-        }
-        else
-        {
-            emboot_printf_i("incorrect!\n");
-        }
+        emboot_printf_i("%d/%d ok!\n", idx+1, emboot_head->patchx_nums);
+        emboot_printf_i("######\n");
+        emboot_printf_i("verify done!\n");
+        return 0;
+    }
+    else
+    {
+        emboot_printf_i("incorrect!\n");
     }
 
     err++;
@@ -567,6 +2817,7 @@ static int emboot_verify(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 {
     int err = 0;
     int crc = 0;
+    int i = 0;
 
     emboot_printf_i("\n");
     emboot_printf_i("update start:\n");
@@ -577,6 +2828,11 @@ static int emboot_verify(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 
 retry_verify_dnload:
     emboot_printf_i("verify [dnload/backup] ");
+    if (embget_verify_info(emboot_ctrl, emboot_head))
+    {
+        emboot_printf_i("ok! (hashed on download)\n");
+    }
+    else
     if (emboot_head->remain_hash != (crc = emboot_calc_hash(emboot_head->remain_size, emboot_head->header_size, emboot_backup_read)))
     {
         emboot_printf_i("error!\n");
@@ -604,42 +2860,37 @@ retry_verify_dnload:
     err = 0;
 
 retry_verify_oldapp:
-    for (int i = 0; i < emboot_head->patchx_nums; ++i)
+    emboot_printf_i("verify [curent/runapp] ");
+    if ((i = emboot_match_oldapp(emboot_head, emboot_oldapp_read)) >= 0)
     {
-        emboot_printf_i("verify [curent/runapp] ");
-        emboot_printf_i("%d/%d ", i+1, emboot_head->patchx_nums);
-
-        if (emboot_head->patchx_data[i].oldapp_size == 0x00000000 ||
-            emboot_head->patchx_data[i].oldapp_size == 0xFFFFFFFF ||
-            emboot_head->patchx_data[i].oldapp_hash == emboot_calc_hash(emboot_head->patchx_data[i].oldapp_size, 0, emboot_runapp_read))
+        emboot_printf_i("%d/%d ok!\n", i+1, emboot_head->patchx_nums);
+        // copy the emboot header to [upctrl] before moving on, as the [dnload/backup] will be erased when backing up the old firmware.
+        emboot_upctrl_write(EMBOOT_MOV_ADDR, (uint8_t *)emboot_head, emboot_head->header_size);
+        emboot_ctrl_begin();
+        embset_patchi_indx(i);
+        embset_update_step(emboot_step_decode, 0);
+        emboot_ctrl_commit();
+        emboot_printf_i("######\n");
+        emboot_printf_i("verify done! ");
+
+        if (emboot_head->patchx_data[i].patchi_type == patchi_type_full_image)
         {
-            emboot_printf_i("ok!\n");
-            embset_patchi_indx(i);
-            embset_update_step(emboot_step_decode, 0);
-            emboot_printf_i("######\n");
-            emboot_printf_i("verify done! ");
-
-            if (emboot_head->patchx_data[i].patchi_type == patchi_type_full_image)
-            {
-                emboot_printf_i("(this is a full update image)\n"); // package = emboot_header + main.bin
-            }
-            if (emboot_head->patchx_data[i].patchi_type == patchi_type_full_patch)
-            {
-                emboot_printf_i("(this is a full update patch)\n"); // package = emboot_header + diff_with_empty.patch
-            }
-            if (emboot_head->patchx_data[i].patchi_type > 0)
-            {
-                emboot_printf_i("(this is a diff update patch)\n"); // package = emboot_header + diff_with_older.patch
-            }
-
-            // copy the emboot header to [upctrl], as the [dnload/backup] will be erased when backing up the old firmware.
-            emboot_upctrl_write(EMBOOT_MOV_ADDR, (uint8_t *)emboot_head, emboot_head->header_size);
-            return emboot_stat_busy;
+            emboot_printf_i("(this is a full update image)\n"); // package = emboot_header + main.bin
         }
-        else
+        if (emboot_head->patchx_data[i].patchi_type == patchi_type_full_patch)
+        {
+            emboot_printf_i("(this is a full update patch)\n"); // package = emboot_header + diff_with_empty.patch
+        }
+        if (emboot_head->patchx_data[i].patchi_type > 0)
         {
-            emboot_printf_i("incorrect!\n");
+            emboot_printf_i("(this is a diff update patch)\n"); // package = emboot_header + diff_with_older.patch
         }
+
+        return emboot_stat_busy;
+    }
+    else
+    {
+        emboot_printf_i("incorrect!\n");
     }
 
     err++;
@@ -668,8 +2919,24 @@ static int emboot_decode(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
     emboot_printf_i("######\n");
 
 retry_decode:
-    emboot_printf_i("erases [decode/newapp]\n");
-    emboot_decode_erase();
+    emboot_ckp_head = EMBOOT_CRC_INIT;
+    emboot_ckp_head_size = 0;
+    emboot_ckp_from = emboot_ckp_start(emboot_head->patchx_data[idx].newapp_hash, emboot_head->patchx_data[idx].newapp_size);
+    if (emboot_ckp_from)
+    {
+        emboot_printf_i("keeps [decode/newapp] below 0x%08X (already programmed), the patch is decoded again from its start\n", emboot_ckp_from);
+    }
+    else
+    {
+        emboot_printf_i("erases [decode/newapp]\n");
+    }
+    emboot_lazy_init(&emboot_decode_lazy, EMBOOT_NEWAPP_ID, emboot_ckp_from);
+    if (hpatch_stream_init() < 0)
+    {
+        emboot_printf_i(NR_SHELL_USER_NAME);
+        embset_update_step(emboot_step_finish, 0);
+        return emboot_stat_idle;
+    }
 
     hpatch_handle_t hpatch = {0};
     hpatch.patch_file_offset = emboot_head->header_size + emboot_head->patchx_data[idx].patchi_addr;
@@ -677,11 +2944,21 @@ retry_decode:
     hpatch.newer_file_length = emboot_head->patchx_data[idx].newapp_size;
 
     int type = emboot_head->patchx_data[idx].patchi_type;
+    uint32_t out = 0;               // crc of the decoder output
+    int reread = EMBOOT_DECODE_REREAD;
 
     if (type <  0)  // full update with image file
     {
         emboot_printf_i("unpack [decode/newapp] <- [dnload/FullUpdateIMAGE] [copying...] ");
-        emboot_copy_data(emboot_head->remain_size, emboot_head->header_size, 0, emboot_backup_read, emboot_decode_write);
+        emboot_copy_data(emboot_head->remain_size - emboot_ckp_from, emboot_head->header_size + emboot_ckp_from, emboot_ckp_from, emboot_backup_read, emboot_decode_write_ckp, RT_NULL, &out);
+        out = embcrc_combine(emboot_ckp_head, out, emboot_head->remain_size - emboot_ckp_from);
+        reread |= emboot_ckp_head_size != emboot_ckp_from;
+    }
+    if (type >= 0)
+    {
+#if !EMBOOT_DECODE_REREAD
+        emboot_hash->init();
+#endif
     }
     if (type == 0)  // full update with patch file
     {
@@ -697,9 +2974,35 @@ retry_decode:
         hpi_patch(&hpatch.parent, EMBOOT_HPATCH_CATCH_SIZE, EMBOOT_DECOMPRESS_CACHE_SIZE, hpatch_stream_read_patch, hpatch_stream_read_old, hpatch_stream_write_new);
         emboot_printf_i("\b\b\b100%%\n");
     }
+    if (type >= 0)
+    {
+        reread |= hpatch_stream_flush(&hpatch) < 0 || hpatch.newer_file_wr_pos != hpatch.newer_file_length;
+#if !EMBOOT_DECODE_REREAD
+        out = emboot_hash->final();
+#endif
+    }
+
+    const uint32_t *blocks = emboot_manifest(emboot_head, emboot_head->patchx_data[idx].newapp_size, emboot_head->patchx_data[idx].newapp_hash);
+    int bad = -1;
 
     emboot_printf_i("verify [decode/newapp] ");
-    if (emboot_head->patchx_data[idx].newapp_hash != (crc = emboot_calc_hash(emboot_head->patchx_data[idx].newapp_size, 0, emboot_decode_read)))
+    if (reread && blocks)
+    {
+        // stops at the first bad block, the blocks add up to newapp_hash.
+        bad = emboot_manifest_check(emboot_head, blocks, 0, emboot_head->patchx_data[idx].newapp_size, emboot_newapp_read);
+        crc = bad < 0 ? emboot_head->patchx_data[idx].newapp_hash : ~emboot_head->patchx_data[idx].newapp_hash;
+    }
+    else
+    if (reread)
+    {
+        crc = emboot_calc_hash(emboot_head->patchx_data[idx].newapp_size, 0, emboot_newapp_read);
+    }
+    else
+    {
+        crc = out;
+        emboot_printf_d("(decoder output) ");
+    }
+    if (emboot_head->patchx_data[idx].newapp_hash != crc)
     {
         emboot_printf_i("error!\n");
         emboot_printf_d("@DEBUG [expect newapp size = 0x%08X]\n", emboot_head->patchx_data[idx].newapp_size);
@@ -715,42 +3018,95 @@ retry_decode:
         else
         {
             emboot_printf_i("retry: %d\n", err);
+            emboot_ckp_limit = bad >= 0 ? bad : 0;          // the logged chunks below a bad block are kept
             goto retry_decode;
         }
     }
     else
     {
         emboot_printf_i("ok!\n");
-        embset_update_step(emboot_step_backup, 0);
+        emboot_lazy_fini(&emboot_decode_lazy, emboot_newapp_read);
+        emboot_ctrl_begin();
+#if EMBOOT_AB_SLOT
+        // the new image is complete, switching the slot is the commit point of the update.
+        if (emboot_ctrl->slot_size[emboot_slot] == 0xFFFFFFFF)
+        {
+            // the running image was not installed by an update, record it so that undo can check it.
+            int size = emboot_used_size(embget_runapp_size(), emboot_oldapp_read);
+            embset_slot_info(emboot_slot, size, emboot_calc_hash(size, 0, emboot_oldapp_read));
+        }
+        embset_slot_info(!emboot_slot, emboot_head->patchx_data[idx].newapp_size, emboot_head->patchx_data[idx].newapp_hash);
+        embset_boot_slot(!emboot_slot);
+        embset_update_step(emboot_step_finish, 0);
+#else
+        embset_decode_info(emboot_head->patchx_data[idx].newapp_size, emboot_head->patchx_data[idx].newapp_hash);
+        embset_update_step(EMBOOT_SWAP_MODE ? emboot_step_docopy : emboot_step_backup, 0);
+#endif
+        emboot_ctrl_commit();
+        emboot_ckp_erase();                                 // the decode is over, a later one must not take up its log
     }
 
     emboot_printf_i("######\n");
     emboot_printf_i("decode done!\n");
 
-    embset_decode_info(emboot_head->patchx_data[idx].newapp_size, emboot_head->patchx_data[idx].newapp_hash);
-
+#if EMBOOT_AB_SLOT
+    emboot_printf_i("boots [slot %c]\n", 'A' + emboot_slot);
+    return emboot_stat_done;
+#else
     return emboot_stat_busy;
+#endif
 }
 
 static int emboot_backup(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 {
+    int err = 0;
+    int pos = 0;
+    uint32_t crc = 0;
+
     emboot_printf_i("\n");
     emboot_printf_i("backup\n");
     emboot_printf_i("######\n");
 
-    emboot_printf_i("erases [dnload/backup]\n");
-    emboot_backup_erase();
+    int size = emboot_used_size(embget_runapp_size(), emboot_runapp_read);
+
+retry_backup:
+    emboot_printf_i("erases [dnload/backup] ");
+    emboot_backup_erase_used(size);
+    emboot_printf_i("\n");
 
     emboot_printf_i("backup [dnload/backup] <- [curent/runapp] ");
-    emboot_copy_data(embget_runapp_size(), 0, 0, emboot_runapp_read, emboot_backup_write);
+    pos = emboot_copy_data(size, 0, 0, emboot_runapp_read, emboot_backup_write, emboot_backup_read, &crc);
     emboot_printf_i("\n");
 
+#if !EMBOOT_COPY_VERIFY
     emboot_printf_i("hasher [curent/runapp] ");
-    int crc = emboot_calc_hash(embget_runapp_size(), 0, emboot_runapp_read);
+    crc = emboot_calc_hash(size, 0, emboot_runapp_read);
     emboot_printf_i("\n");
-    embset_backup_info(embget_runapp_size(), crc);
+#endif
+
+    if (pos >= 0)
+    {
+        emboot_printf_i("verify [dnload/backup] error!\n");
+        emboot_printf_d("@DEBUG [backup mismatch at 0x%08X]\n", pos);
+        err++;
+        if (err >= EMBOOT_MAX_TRYS)
+        {
+            // [curent/runapp] is still untouched, give up the update.
+            emboot_printf_i(NR_SHELL_USER_NAME);
+            embset_update_step(emboot_step_finish, 0);
+            return emboot_stat_idle;
+        }
+        else
+        {
+            emboot_printf_i("retry: %d\n", err);
+            goto retry_backup;
+        }
+    }
 
+    emboot_ctrl_begin();
+    embset_backup_info(size, crc);
     embset_update_step(emboot_step_docopy, 0);
+    emboot_ctrl_commit();
     emboot_printf_i("######\n");
     emboot_printf_i("backup done!\n");
 
@@ -760,28 +3116,53 @@ static int emboot_backup(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 static int emboot_docopy(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 {
     int err = 0;
-    int crc = 0;
+    int pos = 0;
+    uint32_t crc = 0;
     int idx = embget_patchi_indx();
+    const uint32_t *blocks = emboot_manifest(emboot_head, emboot_head->patchx_data[idx].newapp_size, emboot_head->patchx_data[idx].newapp_hash);
 
     emboot_printf_i("\n");
     emboot_printf_i("docopy\n");
     emboot_printf_i("######\n");
 
 retry_docopy:
-    emboot_printf_i("erases [curent/runapp]\n");
-    emboot_runapp_erase();
+#if EMBOOT_SKIP_SAME
+    emboot_printf_i("docopy [curent/runapp] <- [decode/newapp] ");
+    pos = emboot_sync_data(emboot_head->patchx_data[idx].newapp_size, emboot_decode_read, &crc);
+    emboot_printf_i("\n");
+#else
+    emboot_printf_i("erases [curent/runapp] ");
+    emboot_runapp_erase_used(emboot_head->patchx_data[idx].newapp_size);
+    emboot_printf_i("\n");
 
     emboot_printf_i("docopy [curent/runapp] <- [decode/newapp] ");
-    emboot_copy_data(emboot_head->patchx_data[idx].newapp_size, 0, 0, emboot_decode_read, emboot_runapp_write);
+    pos = emboot_copy_data(emboot_head->patchx_data[idx].newapp_size, 0, 0, emboot_decode_read, emboot_runapp_write, emboot_runapp_read, &crc);
     emboot_printf_i("\n");
+#endif
 
     emboot_printf_i("verify [curent/runapp] ");
-    if (emboot_head->patchx_data[idx].newapp_hash != (crc = emboot_calc_hash(emboot_head->patchx_data[idx].newapp_size, 0, emboot_runapp_read)))
+#if !EMBOOT_COPY_VERIFY
+    if (blocks)
+    {
+        pos = emboot_manifest_check(emboot_head, blocks, 0, emboot_head->patchx_data[idx].newapp_size, emboot_runapp_read);
+        crc = emboot_head->patchx_data[idx].newapp_hash;    // the blocks add up to it
+    }
+    else
+    {
+        crc = emboot_calc_hash(emboot_head->patchx_data[idx].newapp_size, 0, emboot_runapp_read);
+    }
+#endif
+check_docopy:
+    if (pos >= 0 || emboot_head->patchx_data[idx].newapp_hash != crc)
     {
         emboot_printf_i("error!\n");
+        emboot_printf_d("@DEBUG [runapp mismatch at 0x%08X]\n", pos);
         emboot_printf_d("@DEBUG [expect runapp size = 0x%08X]\n", emboot_head->patchx_data[idx].newapp_size);
         emboot_printf_d("@DEBUG [expect runapp hash = 0x%08X]\n", emboot_head->patchx_data[idx].newapp_hash);
-        emboot_printf_d("@DEBUG [actual runapp hash = 0x%08X]\n", crc);
+        if (pos < 0)                                        // a mismatch stops the copy before the hash is complete
+        {
+            emboot_printf_d("@DEBUG [actual runapp hash = 0x%08X]\n", crc);
+        }
         err++;
         if (err >= EMBOOT_MAX_TRYS)
         {
@@ -790,6 +3171,16 @@ retry_docopy:
             return emboot_stat_busy;
         }
         else
+        if (blocks)
+        {
+            emboot_printf_i("retry: %d\n", err);
+            emboot_printf_i("mended [curent/runapp] <- [decode/newapp] ");
+            // the blocks below pos are good, the mend checks all the others.
+            pos = emboot_manifest_mend(emboot_head, blocks, pos >= 0 ? pos : 0, emboot_head->patchx_data[idx].newapp_size, emboot_decode_read);
+            crc = emboot_head->patchx_data[idx].newapp_hash;
+            goto check_docopy;
+        }
+        else
         {
             emboot_printf_i("retry: %d\n", err);
             goto retry_docopy;
@@ -813,7 +3204,8 @@ retry_docopy:
 static int emboot_revert(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 {
     int err = 0;
-    int crc = 0;
+    int pos = 0;
+    uint32_t crc = 0;
 
     emboot_printf_i("\n");
     emboot_printf_i("revert (undo/rollback)\n");
@@ -848,20 +3240,34 @@ retry_verify_backup:
     }
 
 retry_revert:
-    emboot_printf_i("erases [curent/runapp]\n");
-    emboot_runapp_erase();
+#if EMBOOT_SKIP_SAME
+    emboot_printf_i("revert [curent/runapp] <- [backup/oldapp] ");
+    pos = emboot_sync_data(emboot_ctrl->backup_size, emboot_backup_read, &crc);
+    emboot_printf_i("\n");
+#else
+    emboot_printf_i("erases [curent/runapp] ");
+    emboot_runapp_erase_used(emboot_ctrl->backup_size);
+    emboot_printf_i("\n");
 
     emboot_printf_i("revert [curent/runapp] <- [backup/oldapp] ");
-    emboot_copy_data(emboot_ctrl->backup_size, 0, 0, emboot_backup_read, emboot_runapp_write);
+    pos = emboot_copy_data(emboot_ctrl->backup_size, 0, 0, emboot_backup_read, emboot_runapp_write, emboot_runapp_read, &crc);
     emboot_printf_i("\n");
+#endif
 
     emboot_printf_i("verify [curent/runapp] ");
-    if (emboot_ctrl->backup_hash != (crc = emboot_calc_hash(emboot_ctrl->backup_size, 0, emboot_runapp_read)))
+#if !EMBOOT_COPY_VERIFY
+    crc = emboot_calc_hash(emboot_ctrl->backup_size, 0, emboot_runapp_read);
+#endif
+    if (pos >= 0 || emboot_ctrl->backup_hash != crc)
     {
         emboot_printf_i("error!\n");
+        emboot_printf_d("@DEBUG [runapp mismatch at 0x%08X]\n", pos);
         emboot_printf_d("@DEBUG [expect runapp size = 0x%08X]\n", emboot_ctrl->backup_size);
         emboot_printf_d("@DEBUG [expect runapp hash = 0x%08X]\n", emboot_ctrl->backup_hash);
-        emboot_printf_d("@DEBUG [actual runapp hash = 0x%08X]\n", crc);
+        if (pos < 0)                                        // a mismatch stops the copy before the hash is complete
+        {
+            emboot_printf_d("@DEBUG [actual runapp hash = 0x%08X]\n", crc);
+        }
         err++;
         if (err >= EMBOOT_MAX_TRYS)
         {
@@ -890,7 +3296,9 @@ retry_revert:
 static int emboot_recopy(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 {
     int err = 0;
-    int crc = 0;
+    int pos = 0;
+    uint32_t crc = 0;
+    const uint32_t *blocks = emboot_manifest(emboot_head, emboot_ctrl->decode_size, emboot_ctrl->decode_hash);
 
     emboot_printf_i("\n");
     emboot_printf_i("recopy (redo/rollforward)\n");
@@ -898,9 +3306,19 @@ static int emboot_recopy(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 
 retry_verify_decode:
     emboot_printf_i("verify [decode/newapp] ");
+    if (blocks)
+    {
+        // stops at the first bad block, the blocks add up to decode_hash.
+        crc = emboot_manifest_check(emboot_head, blocks, 0, emboot_ctrl->decode_size, emboot_decode_read) < 0 ? emboot_ctrl->decode_hash : ~emboot_ctrl->decode_hash;
+    }
+    else
+    if (emboot_ctrl->decode_size != 0x00000000 && emboot_ctrl->decode_size != 0xFFFFFFFF)
+    {
+        crc = emboot_calc_hash(emboot_ctrl->decode_size, 0, emboot_decode_read);
+    }
     if (emboot_ctrl->decode_size == 0x00000000 ||
         emboot_ctrl->decode_size == 0xFFFFFFFF ||
-        emboot_ctrl->decode_hash != (crc = emboot_calc_hash(emboot_ctrl->decode_size, 0, emboot_decode_read)))
+        emboot_ctrl->decode_hash != crc)
     {
         emboot_printf_i("error!\n");
         emboot_printf_d("@DEBUG [expect decode size = 0x%08X]\n", emboot_ctrl->decode_size);
@@ -925,20 +3343,43 @@ retry_verify_decode:
     }
 
 retry_recopy:
-    emboot_printf_i("erases [curent/runapp]\n");
-    emboot_runapp_erase();
+#if EMBOOT_SKIP_SAME
+    emboot_printf_i("recopy [curent/runapp] <- [decode/newapp] ");
+    pos = emboot_sync_data(emboot_ctrl->decode_size, emboot_decode_read, &crc);
+    emboot_printf_i("\n");
+#else
+    emboot_printf_i("erases [curent/runapp] ");
+    emboot_runapp_erase_used(emboot_ctrl->decode_size);
+    emboot_printf_i("\n");
 
     emboot_printf_i("recopy [curent/runapp] <- [decode/newapp] ");
-    emboot_copy_data(emboot_ctrl->decode_size, 0, 0, emboot_decode_read, emboot_runapp_write);
+    pos = emboot_copy_data(emboot_ctrl->decode_size, 0, 0, emboot_decode_read, emboot_runapp_write, emboot_runapp_read, &crc);
     emboot_printf_i("\n");
+#endif
 
     emboot_printf_i("verify [curent/runapp] ");
-    if (emboot_ctrl->decode_hash != (crc = emboot_calc_hash(emboot_ctrl->decode_size, 0, emboot_runapp_read)))
+#if !EMBOOT_COPY_VERIFY
+    if (blocks)
+    {
+        pos = emboot_manifest_check(emboot_head, blocks, 0, emboot_ctrl->decode_size, emboot_runapp_read);
+        crc = emboot_ctrl->decode_hash;                     // the blocks add up to it
+    }
+    else
+    {
+        crc = emboot_calc_hash(emboot_ctrl->decode_size, 0, emboot_runapp_read);
+    }
+#endif
+check_recopy:
+    if (pos >= 0 || emboot_ctrl->decode_hash != crc)
     {
         emboot_printf_i("error!\n");
+        emboot_printf_d("@DEBUG [runapp mismatch at 0x%08X]\n", pos);
         emboot_printf_d("@DEBUG [expect runapp size = 0x%08X]\n", emboot_ctrl->decode_size);
         emboot_printf_d("@DEBUG [expect runapp hash = 0x%08X]\n", emboot_ctrl->decode_hash);
-        emboot_printf_d("@DEBUG [actual runapp hash = 0x%08X]\n", crc);
+        if (pos < 0)                                        // a mismatch stops the copy before the hash is complete
+        {
+            emboot_printf_d("@DEBUG [actual runapp hash = 0x%08X]\n", crc);
+        }
         err++;
         if (err >= EMBOOT_MAX_TRYS)
         {
@@ -947,6 +3388,16 @@ retry_recopy:
             return emboot_stat_idle;
         }
         else
+        if (blocks)
+        {
+            emboot_printf_i("retry: %d\n", err);
+            emboot_printf_i("mended [curent/runapp] <- [decode/newapp] ");
+            // the blocks below pos are good, the mend checks all the others.
+            pos = emboot_manifest_mend(emboot_head, blocks, pos >= 0 ? pos : 0, emboot_ctrl->decode_size, emboot_decode_read);
+            crc = emboot_ctrl->decode_hash;
+            goto check_recopy;
+        }
+        else
         {
             emboot_printf_i("retry: %d\n", err);
             goto retry_recopy;
@@ -967,31 +3418,53 @@ retry_recopy:
 static int emboot_rocopy(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 {
     int err = 0;
-    int crc = 0;
+    int pos = 0;
+    uint32_t crc = 0;
 
     emboot_printf_i("\n");
     emboot_printf_i("recopy (redo/rollforward -f)\n");
     emboot_printf_i("######\n");
 
+    int size = emboot_used_size(embget_runapp_size(), emboot_decode_read);
+
+#if !EMBOOT_COPY_VERIFY
     emboot_printf_i("hasher [decode/newapp] ");
-    int decode_hash = emboot_calc_hash(embget_runapp_size(), 0, emboot_decode_read);
+    int decode_hash = emboot_calc_hash(size, 0, emboot_decode_read);
     emboot_printf_i("\n");
+#endif
 
 retry_recopy:
-    emboot_printf_i("erases [curent/runapp]\n");
-    emboot_runapp_erase();
+#if EMBOOT_SKIP_SAME
+    emboot_printf_i("recopy [curent/runapp] <- [decode/newapp] ");
+    pos = emboot_sync_data(size, emboot_decode_read, &crc);
+    emboot_printf_i("\n");
+#else
+    emboot_printf_i("erases [curent/runapp] ");
+    emboot_runapp_erase_used(size);
+    emboot_printf_i("\n");
 
     emboot_printf_i("recopy [curent/runapp] <- [decode/newapp] ");
-    emboot_copy_data(embget_runapp_size(), 0, 0, emboot_decode_read, emboot_runapp_write);
+    pos = emboot_copy_data(size, 0, 0, emboot_decode_read, emboot_runapp_write, emboot_runapp_read, &crc);
     emboot_printf_i("\n");
+#endif
 
     emboot_printf_i("verify [curent/runapp] ");
-    if (decode_hash != (crc = emboot_calc_hash(embget_runapp_size(), 0, emboot_runapp_read)))
+#if !EMBOOT_COPY_VERIFY
+    if (decode_hash != (crc = emboot_calc_hash(size, 0, emboot_runapp_read)))
+#else
+    if (pos >= 0)
+#endif
     {
         emboot_printf_i("error!\n");
-        emboot_printf_d("@DEBUG [expect runapp size = 0x%08X]\n", embget_runapp_size());
+        emboot_printf_d("@DEBUG [runapp mismatch at 0x%08X]\n", pos);
+        emboot_printf_d("@DEBUG [expect runapp size = 0x%08X]\n", size);
+#if !EMBOOT_COPY_VERIFY
         emboot_printf_d("@DEBUG [expect runapp hash = 0x%08X]\n", decode_hash);
-        emboot_printf_d("@DEBUG [actual runapp hash = 0x%08X]\n", crc);
+#endif
+        if (pos < 0)                                        // a mismatch stops the copy before the hash is complete
+        {
+            emboot_printf_d("@DEBUG [actual runapp hash = 0x%08X]\n", crc);
+        }
         err++;
         if (err >= EMBOOT_MAX_TRYS)
         {
@@ -1017,6 +3490,335 @@ retry_recopy:
     return emboot_stat_done;
 }
 
+#if EMBOOT_AB_SLOT
+/**
+ * A/B slot mode: undo and redo switch to the other slot, after checking its image (redo -f skips the check).
+ */
+static int emboot_switch(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
+{
+    int err = 0;
+    int other = !emboot_slot;
+    uint32_t size = emboot_ctrl->slot_size[other];
+    uint32_t hash = emboot_ctrl->slot_hash[other];
+    uint32_t crc = 0;
+
+    emboot_printf_i("\n");
+    emboot_printf_i("switch\n");
+    emboot_printf_i("######\n");
+
+    if (emboot_ctrl->update_step == emboot_step_rocopy)
+    {
+        goto switch_slot;
+    }
+
+retry_switch:
+    emboot_printf_i("verify [slot %c] ", 'A' + other);
+    if (size == 0x00000000 || size == 0xFFFFFFFF ||
+        hash != (crc = emboot_calc_hash(size, 0, emboot_newapp_read)))
+    {
+        emboot_printf_i("error!\n");
+        emboot_printf_d("@DEBUG [expect slot size = 0x%08X]\n", size);
+        emboot_printf_d("@DEBUG [expect slot hash = 0x%08X]\n", hash);
+        emboot_printf_d("@DEBUG [actual slot hash = 0x%08X]\n", crc);
+        err++;
+        if (err >= EMBOOT_MAX_TRYS || size == 0x00000000 || size == 0xFFFFFFFF)
+        {
+            emboot_printf_i(NR_SHELL_USER_NAME);
+            embset_update_step(emboot_step_finish, 0);
+            return emboot_stat_idle;
+        }
+        else
+        {
+            emboot_printf_i("retry: %d\n", err);
+            goto retry_switch;
+        }
+    }
+    emboot_printf_i("ok!\n");
+
+switch_slot:
+    emboot_ctrl_begin();
+    embset_boot_slot(other);
+    embset_update_step(emboot_step_finish, 0);
+    emboot_ctrl_commit();
+
+    emboot_printf_i("######\n");
+    emboot_printf_i("switch done! boots [slot %c]\n", 'A' + emboot_slot);
+
+    return emboot_stat_done;
+}
+#endif
+
+#if EMBOOT_SWAP_MODE
+/**
+ * sector swap progress log at [upctrl:EMBOOT_SWP_ADDR]: record 0 holds the number of sectors, record k+1 is written
+ * once step k is done (sector k / 3, step k % 3).
+ *
+ * whoever requests a swap (decode, undo, redo) leaves an empty log behind, any record found means resume.
+ */
+#define EMBOOT_SWP_NUMS                 (EMBOOT_SWP_SIZE / sizeof(emboot_rec_t))
+
+static int emboot_swp_get(int index, uint32_t *data) { return emboot_rec_get(EMBOOT_SWP_ADDR, index, data); }
+static int emboot_swp_set(int index, uint32_t data)  { return emboot_rec_set(EMBOOT_SWP_ADDR, index, data); }
+
+/**
+ * return: number of valid records, the log is written strictly in order.
+ */
+static int emboot_swp_scan(void)
+{
+    int nums = 0;
+    uint32_t data;
+    while (nums < EMBOOT_SWP_NUMS && emboot_swp_get(nums, &data) == 0 && (nums == 0 || data == nums - 1))
+    {
+        nums++;
+    }
+    return nums;
+}
+
+/**
+ * part == RT_NULL: checks the first size bytes of emboot_copy_buffer instead.
+ */
+static int emboot_swap_blank(const struct fal_partition *part, uint32_t addr, uint32_t size)
+{
+    for (uint32_t pos = 0; pos < size; pos += sizeof(emboot_copy_buffer))
+    {
+        uint32_t len = size - pos > sizeof(emboot_copy_buffer) ? sizeof(emboot_copy_buffer) : size - pos;
+        if (part)
+        {
+            emboot_part_read(part, addr + pos, emboot_copy_buffer, len);
+        }
+        for (uint32_t i = 0; i < len; ++i)
+        {
+            if (emboot_copy_buffer[i] != 0xFF)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/**
+ * step 0: [scratch] <- [curent/runapp], step 1: [curent/runapp] <- [decode/newapp], step 2: [decode/newapp] <- [scratch].
+ * every step reads a sector the previous steps left alone, so an interrupted one is simply run again.
+ */
+static int emboot_swap_step(uint32_t sector, int step, uint32_t unit)
+{
+    static const emboot_part_t id[3][2] = {{emboot_part_scratch, emboot_part_runapp}, {emboot_part_runapp, emboot_part_decode}, {emboot_part_decode, emboot_part_scratch}};
+    const struct fal_partition *dst = emboot_part(id[step][0]);
+    const struct fal_partition *src = emboot_part(id[step][1]);
+    uint32_t dst_addr = step == 0 ? 0 : sector * unit;
+    uint32_t src_addr = step == 2 ? 0 : sector * unit;
+
+    // the tail of the longer image meets erased sectors, reading costs less than erasing and programming 0xFF.
+    if (!emboot_swap_blank(dst, dst_addr, unit) && emboot_part_erase(dst, dst_addr, unit) < 0)
+    {
+        return -1;
+    }
+    for (uint32_t pos = 0; pos < unit; pos += sizeof(emboot_copy_buffer))
+    {
+        uint32_t len = unit - pos > sizeof(emboot_copy_buffer) ? sizeof(emboot_copy_buffer) : unit - pos;
+        emboot_part_read(src, src_addr + pos, emboot_copy_buffer, len);
+        if (emboot_swap_blank(RT_NULL, 0, len))
+        {
+            continue;
+        }
+        emboot_part_write(dst, dst_addr + pos, emboot_copy_buffer, len);
+#if EMBOOT_COPY_VERIFY
+        emboot_part_read(dst, dst_addr + pos, emboot_back_buffer, len);
+        if (memcmp(emboot_copy_buffer, emboot_back_buffer, len) != 0)
+        {
+            emboot_printf_d("(mismatch in [%s] at 0x%08X) ", dst->name, dst_addr + pos);
+            return -1;
+        }
+#endif
+    }
+    return 0;
+}
+
+/**
+ * a swap that cannot go on. [curent/runapp] is booted only if nothing has been swapped yet and it still holds its
+ * image (back_size/back_hash), else the step and the swap log are kept, so that the swap resumes after a reset.
+ */
+static int emboot_swap_stop(uint32_t back_size, uint32_t back_hash, int swapped)
+{
+    if (!swapped && back_size != 0x00000000 && back_size != 0xFFFFFFFF &&
+        back_hash == emboot_calc_hash(back_size, 0, emboot_runapp_read))
+    {
+        emboot_printf_i(NR_SHELL_USER_NAME);
+        embset_update_step(emboot_step_finish, 0);
+        return emboot_stat_idle;
+    }
+
+    emboot_printf_i("[curent/runapp] is broken, the swap resumes after a reset.\n");
+    emboot_printf_i(NR_SHELL_USER_NAME);
+    emboot_swap_halt = 1;
+    return emboot_stat_idle;
+}
+
+/**
+ * swap mode: docopy, undo and redo exchange [curent/runapp] and [decode/newapp], the old image is kept in
+ * [decode/newapp] (described by backup_size/backup_hash) instead of [dnload/backup].
+ */
+static int emboot_swap(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
+{
+    int err = 0;
+    uint32_t crc = 0;
+    uint32_t step = emboot_ctrl->update_step;
+    uint32_t size = step == emboot_step_revert ? emboot_ctrl->backup_size : emboot_ctrl->decode_size; // image that ends up in [curent/runapp]
+    uint32_t hash = step == emboot_step_revert ? emboot_ctrl->backup_hash : emboot_ctrl->decode_hash;
+    uint32_t back = step == emboot_step_revert ? emboot_ctrl->decode_size : emboot_ctrl->backup_size; // image that ends up in [decode/newapp]
+    uint32_t back_hash = step == emboot_step_revert ? emboot_ctrl->decode_hash : emboot_ctrl->backup_hash;
+
+    if (emboot_swap_halt)
+    {
+        return emboot_stat_idle;
+    }
+
+    const struct fal_partition *runapp = emboot_part(emboot_part_runapp);
+    const struct fal_partition *decode = emboot_part(emboot_part_decode);
+    const struct fal_partition *scratch = emboot_part(emboot_part_scratch);
+    uint32_t unit = emboot_lazy_blks(runapp) > emboot_lazy_blks(decode) ? emboot_lazy_blks(runapp) : emboot_lazy_blks(decode);
+    uint32_t part = runapp->len < decode->len ? runapp->len : decode->len;
+    uint32_t sectors;
+
+    emboot_printf_i("\n");
+    emboot_printf_i(step == emboot_step_docopy ? "docopy (swap)\n" : step == emboot_step_revert ? "revert (swap)\n" : "recopy (swap)\n");
+    emboot_printf_i("######\n");
+
+    if (scratch == RT_NULL || scratch->len < unit)
+    {
+        emboot_printf_e("swap needs a [%s] partition of %d bytes at least!\n", EMBOOT_SCRATCH_PART, unit);
+        embset_update_step(emboot_step_finish, 0);
+        return emboot_stat_idle;
+    }
+
+    int nums = emboot_swp_scan();
+    if (nums == 0)
+    {
+        if (step == emboot_step_docopy && emboot_ctrl->backup_size == 0xFFFFFFFF)
+        {
+            // the image given away, so that undo can check it.
+            back = emboot_used_size(part, emboot_runapp_read);
+            back_hash = emboot_calc_hash(back, 0, emboot_runapp_read);
+            embset_backup_info(back, back_hash);
+        }
+
+retry_verify_decode:
+        if (step == emboot_step_revert || step == emboot_step_recopy)
+        {
+            emboot_printf_i("verify [decode/newapp] ");
+            if (size == 0x00000000 || size == 0xFFFFFFFF ||
+                hash != (crc = emboot_calc_hash(size, 0, emboot_decode_read)))
+            {
+                emboot_printf_i("error!\n");
+                emboot_printf_d("@DEBUG [expect decode size = 0x%08X]\n", size);
+                emboot_printf_d("@DEBUG [expect decode hash = 0x%08X]\n", hash);
+                emboot_printf_d("@DEBUG [actual decode hash = 0x%08X]\n", crc);
+                err++;
+                if (err >= EMBOOT_MAX_TRYS || size == 0x00000000 || size == 0xFFFFFFFF)
+                {
+                    return emboot_swap_stop(back, back_hash, 0);
+                }
+                else
+                {
+                    emboot_printf_i("retry: %d\n", err);
+                    goto retry_verify_decode;
+                }
+            }
+            emboot_printf_i("ok!\n");
+        }
+
+        if (step == emboot_step_rocopy || size > part || back > part)
+        {
+            // the images are not known, only their used sizes.
+            size = emboot_used_size(part, emboot_decode_read);
+            back = emboot_used_size(part, emboot_runapp_read);
+        }
+        else
+        {
+            // [decode/newapp] may still hold the tail of an earlier, longer image behind this one.
+            emboot_lazy_t tail;
+            emboot_lazy_init(&tail, emboot_part_decode, (size + unit - 1) / unit * unit);
+            emboot_lazy_fini(&tail, emboot_decode_read);
+        }
+        sectors = ((size > back ? size : back) + unit - 1) / unit;
+        sectors = sectors < part / unit ? sectors : part / unit;
+        if (sectors * 3 + 1 > EMBOOT_SWP_NUMS)
+        {
+            emboot_printf_e("swap log too small for %d sectors!\n", sectors);
+            embset_update_step(emboot_step_finish, 0);
+            return emboot_stat_idle;
+        }
+        emboot_swp_set(0, sectors);
+        nums = 1;
+    }
+    else
+    {
+        emboot_swp_get(0, &sectors);
+        emboot_printf_i("resume at sector %d/%d\n", (nums - 1) / 3, sectors);
+    }
+
+    emboot_printf_i("swap [curent/runapp] <-> [decode/newapp] ");
+    emboot_printf_i("00%%");
+    for (uint32_t k = nums - 1; k < sectors * 3; ++k)
+    {
+        if (k % 3 == 0 && k / 3 * 100 / sectors % 5 == 0)
+        {
+            emboot_printf_i("\b\b\b%02d%%", k / 3 * 100 / sectors);
+        }
+
+        err = 0;
+        while (emboot_swap_step(k / 3, k % 3, unit) < 0)
+        {
+            if (++err >= EMBOOT_MAX_TRYS)
+            {
+                emboot_printf_i("error!\n");
+                emboot_printf_d("@DEBUG [swap failed at sector %d step %d]\n", k / 3, k % 3);
+                return emboot_swap_stop(back, back_hash, k > 0);
+            }
+        }
+        emboot_swp_set(k + 1, k);
+        emboot_slice(unit);
+    }
+    emboot_printf_i("\b\b\b100%% ");
+    emboot_printf_d("(swapped sectors = %d, %d bytes each) ", sectors, unit);
+    emboot_printf_i("\n");
+
+    if (step != emboot_step_rocopy)
+    {
+        emboot_printf_i("verify [curent/runapp] ");
+        if (hash != (crc = emboot_calc_hash(size, 0, emboot_runapp_read)))
+        {
+            emboot_printf_i("error!\n");
+            emboot_printf_d("@DEBUG [expect runapp size = 0x%08X]\n", size);
+            emboot_printf_d("@DEBUG [expect runapp hash = 0x%08X]\n", hash);
+            emboot_printf_d("@DEBUG [actual runapp hash = 0x%08X]\n", crc);
+            if (step == emboot_step_docopy)
+            {
+                // the old image is whole in [decode/newapp], swap it back.
+                emboot_printf_i(NR_SHELL_USER_NAME);
+                embset_update_step(emboot_step_revert, 1);
+                return emboot_stat_busy;
+            }
+            return emboot_swap_stop(back, back_hash, 1);
+        }
+        emboot_printf_i("ok!\n");
+    }
+    embset_update_step(emboot_step_finish, 0);
+
+    emboot_printf_i("######\n");
+    emboot_printf_i("swap done!\n");
+
+    if (step == emboot_step_docopy)
+    {
+        emboot_printf_i("\n");
+        emboot_printf_i("update success!\n");
+    }
+
+    return emboot_stat_done;
+}
+#endif
+
 typedef int (*method_t)(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head);
 
 typedef struct update_t
@@ -1028,21 +3830,45 @@ typedef struct update_t
 static const update_t update[] =
 {
     {emboot_step_verify, emboot_verify,},
+#if EMBOOT_AB_SLOT
+    {emboot_step_decode, emboot_decode,}, // dnload -> other slot, then switch
+    {emboot_step_revert, emboot_switch,}, // switch to the other slot
+    {emboot_step_recopy, emboot_switch,}, // switch to the other slot
+    {emboot_step_rocopy, emboot_switch,}, // switch to the other slot (unchecked)
+#elif EMBOOT_SWAP_MODE
+    {emboot_step_decode, emboot_decode,}, // dnload -> decode
+    {emboot_step_docopy, emboot_swap,  }, // runapp <-> decode
+    {emboot_step_revert, emboot_swap,  }, // runapp <-> decode (back to backup_size bytes)
+    {emboot_step_recopy, emboot_swap,  }, // runapp <-> decode (again to decode_size bytes)
+    {emboot_step_rocopy, emboot_swap,  }, // runapp <-> decode (whole partition, unchecked)
+#else
     {emboot_step_decode, emboot_decode,}, // dnload -> decode
     {emboot_step_backup, emboot_backup,}, // runapp -> backup
     {emboot_step_docopy, emboot_docopy,}, // decode -> runapp
     {emboot_step_revert, emboot_revert,}, // backup -> runapp
     {emboot_step_recopy, emboot_recopy,}, // decode -> runapp (copy decode_size bytes)
     {emboot_step_rocopy, emboot_rocopy,}, // decode -> runapp (copy runapp_size bytes)
+#endif
 };
 
 int emboot_header(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
 {
     int first8B = sizeof(emboot_head->header_size) + sizeof(emboot_head->header_hash);
     if (emboot_ctrl->update_step == emboot_step_revert ||
-        emboot_ctrl->update_step == emboot_step_recopy)
+        emboot_ctrl->update_step == emboot_step_recopy ||
+        (EMBOOT_AB_SLOT && emboot_ctrl->update_step == emboot_step_rocopy))
     {
-        // no need update header.
+        // no need update header, but the one of the last update is kept (for its block manifest) while [upctrl] holds it.
+        emboot_upctrl_read(EMBOOT_MOV_ADDR, (uint8_t *)emboot_head, first8B);
+        if (emboot_head->header_size >= sizeof(emboot_head_t) && emboot_head->header_size <= sizeof(emboot_head_buffer))
+        {
+            emboot_upctrl_read(EMBOOT_MOV_ADDR, (uint8_t *)emboot_head, emboot_head->header_size);
+        }
+        if (emboot_head->header_size < sizeof(emboot_head_t) || emboot_head->header_size > sizeof(emboot_head_buffer) ||
+            emboot_head->header_hash != embcrc((uint8_t *)emboot_head + first8B, emboot_head->header_size - first8B, EMBOOT_CRC_INIT))
+        {
+            memset(emboot_head, 0xFF, sizeof(emboot_head_t));
+        }
     }
     else
     if (emboot_ctrl->update_step == emboot_step_verify)
@@ -1084,11 +3910,50 @@ int emboot_header(emboot_ctrl_t *emboot_ctrl, emboot_head_t *emboot_head)
     return 0;
 }
 
+/**
+ * an update phase runs to its end in one emboot_update call, hpi_patch decodes in one call as well. instead of
+ * returning, the phases hand a slice to emboot_poll between bounded chunks of work (EMBOOT_SLICE_BYTES bytes or
+ * EMBOOT_SLICE_TICKS ticks), so the console, the led and the watchdog keep being served. the commands that change
+ * the update state are refused while a phase runs (emboot_job).
+ */
+static int emboot_job;
+static uint32_t emboot_slice_bytes;
+static rt_tick_t emboot_slice_tick;
+static uint32_t emboot_slice_count;                         // slices, since boot
+static int emboot_slice_busy;
+
+static void emboot_poll(void);
+
+static void emboot_slice(uint32_t bytes)
+{
+#if EMBOOT_SLICE_BYTES
+    emboot_slice_bytes += bytes;
+    if (!emboot_job || emboot_slice_busy ||
+        (emboot_slice_bytes < EMBOOT_SLICE_BYTES && rt_tick_get() - emboot_slice_tick < EMBOOT_SLICE_TICKS))
+    {
+        return;
+    }
+    emboot_slice_busy = 1;
+    emboot_slice_count++;
+    emboot_poll();
+    emboot_yield();
+    emboot_slice_bytes = 0;
+    emboot_slice_tick = rt_tick_get();
+    emboot_slice_busy = 0;
+#endif
+}
+
+uint32_t embget_slice_stat(void)
+{
+    return emboot_slice_count;
+}
+
 int emboot_update(void)
 {
-    emboot_ctrl_t emboot_ctrl = {0};
-    memset(&emboot_ctrl, 0xff, sizeof(emboot_ctrl_t));
-    emboot_upctrl_read(0, (uint8_t *)&emboot_ctrl, sizeof(emboot_ctrl_t));
+    emboot_ctrl_t emboot_ctrl = *emboot_ctrl_load();
+#if EMBOOT_AB_SLOT
+    emboot_slot = emboot_slot_of(emboot_ctrl.slot_flip);
+#endif
 
     for (int i = 0; i < sizeof(update) / sizeof(update[0]); ++i)
     {
@@ -1103,7 +3968,10 @@ int emboot_update(void)
             }
 
             emboot_led_fast();
-            return update[i].method(&emboot_ctrl, emboot_head);
+            emboot_job = 1;
+            result = update[i].method(&emboot_ctrl, emboot_head);
+            emboot_job = 0;
+            return result;
         }
     }
 
@@ -1158,12 +4026,26 @@ void emboot_jump_call(void)
     emboot_over = 1;
 }
 
-void emboot_jump(void)
+/**
+ * start address of the image to boot. in A/B slot mode this reads the memory mapped [upctrl], so it also works
+ * before anything is initialized.
+ */
+static uintptr_t emboot_boot_base(void)
+{
+#if EMBOOT_AB_SLOT
+    const emboot_ctrl_t *ctrl = emboot_ctrl_map();
+    if (ctrl && emboot_slot_of(ctrl->slot_flip))
+    {
+        return __decode_zone_addr;
+    }
+#endif
+    return __runapp_zone_addr;
+}
+
+void emboot_jump(uintptr_t base)
 {
-    typedef void (*emboot_jump_t)(void);
-    emboot_jump_t JumpToApplication = (emboot_jump_t)(*((__IO uint32_t *)(__runapp_zone_addr + 4)));
-    uint32_t Msp4B = *((__IO uint32_t *)(__runapp_zone_addr + 0));
-    uint32_t App4B = *((__IO uint32_t *)(__runapp_zone_addr + 4));
+    uint32_t Msp4B = *((__IO uint32_t *)(base + 0));
+    uint32_t App4B = *((__IO uint32_t *)(base + 4));
 
 #if EMBOOT_MSP_MASK != 0
     if ((Msp4B & EMBOOT_MSP_MASK) != EMBOOT_MSP_DATA)
@@ -1181,30 +4063,20 @@ void emboot_jump(void)
     }
 #endif
 
-    __disable_irq();
-    SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
-    for (int i = 0; i < sizeof(NVIC->ICER)/sizeof(NVIC->ICER[0]); ++i)
-    {
-        NVIC->ICER[i] = 0xFFFFFFFF;
-        NVIC->ICPR[i] = 0xFFFFFFFF;
-    }
-
-    __set_CONTROL(0);
-    __set_MSP(Msp4B);
-
-    JumpToApplication();
+    emboot_jump_arch(Msp4B, App4B);
 }
 
 void emboot_fast_boot(void)
 {
-    emboot_ctrl_t *ctrl = (emboot_ctrl_t *)__update_zone_addr;
-    int data = *(uint32_t *)__runapp_zone_addr;
-    int step = ctrl->update_step;
-    int stay = ctrl->update_stay;
+    const emboot_ctrl_t *ctrl = emboot_ctrl_map();
+    uintptr_t base = emboot_boot_base();
+    int data = *(uint32_t *)base;
+    int step = ctrl ? ctrl->update_step : -1;
+    int stay = ctrl ? ctrl->update_stay : -1;
     int jump = (data != -1) && (step == -1 || step == 0) && (stay == -1 || stay == 0);
     if (jump)
     {
-        emboot_jump();
+        emboot_jump(base);
     }
 }
 
@@ -1220,7 +4092,7 @@ void emboot_full_boot(void)
 
         emboot_fini();
 
-        emboot_jump();
+        emboot_jump(emboot_boot_base());
     }
 }
 
@@ -1272,6 +4144,23 @@ void emboot_info(void)
 #endif
 }
 
+/**
+ * serves the console, and the led and the watchdog (EMBOOT_POLL_TICK): once per emboot_core, and at every slice of
+ * an update phase.
+ */
+static void emboot_poll(void)
+{
+    unsigned char c;
+    if (emboot_getc(&c, 1) == 1)
+    {
+        emboot_bash(c);
+        emboot_time = rt_tick_get();
+    }
+#if EMBOOT_POLL_TICK
+    emboot_tick();
+#endif
+}
+
 void emboot_core(void)
 {
     if (!emboot_mark)
@@ -1281,13 +4170,10 @@ void emboot_core(void)
         emboot_mark = 1;
     }
 
-    unsigned char c;
-    if (emboot_getc(&c, 1) == 1)
-    {
-        emboot_bash(c);
-        emboot_time = rt_tick_get();
-    }
+    emboot_poll();
 
+    emboot_slice_bytes = 0;
+    emboot_slice_tick = rt_tick_get();
     int emboot_stat = emboot_update();
     if (emboot_stat == emboot_stat_busy)
     {
@@ -1320,25 +4206,258 @@ void emboot_tick(void)
 }
 
 int embrym_recv_idx;
+static emboot_lazy_t embrym_recv_lazy;
+
+/**
+ * download progress log at [upctrl:EMBOOT_RSM_ADDR]: record 0 holds the package size, record n+1 the crc of
+ * chunk n once it is programmed and read back.
+ */
+#define EMBRYM_RSM_NUMS                 (EMBOOT_RSM_SIZE / sizeof(emboot_rec_t) - 1)
+
+static uint32_t embrym_rsm_from;                            // resume offset of the current download
+static uint32_t embrym_rsm_hash;                            // crc of the chunk being received
+
+static int embrym_rsm_get(int index, uint32_t *data) { return emboot_rec_get(EMBOOT_RSM_ADDR, index, data); }
+static int embrym_rsm_set(int index, uint32_t data)  { return emboot_rec_set(EMBOOT_RSM_ADDR, index, data); }
+
+static int embrym_rsm_erase(void)
+{
+    if (EMBOOT_RSM_SIZE == 0) return 0;
+    return emboot_part_erase_slice(emboot_part(emboot_part_upctrl), EMBOOT_RSM_ADDR, EMBOOT_RSM_SIZE);
+}
+
+/**
+ * logs the chunk once its last byte is programmed.
+ */
+static void embrym_rsm_feed(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    if (addr % EMBOOT_RSM_CHUNK == 0)
+    {
+        embrym_rsm_hash = EMBOOT_CRC_INIT;
+    }
+    embrym_rsm_hash = embcrc(data, size, embrym_rsm_hash);
+
+    uint32_t index = addr / EMBOOT_RSM_CHUNK;
+    if ((addr + size) % EMBOOT_RSM_CHUNK == 0 && index < EMBRYM_RSM_NUMS)
+    {
+        embrym_rsm_set(index + 1, embrym_rsm_hash);
+    }
+}
+
+/**
+ * checks the logged chunks against [dnload/backup].
+ *
+ * return: offset to continue from, a multiple of the erase block of [dnload/backup].
+ */
+static uint32_t embrym_rsm_scan(void)
+{
+    const struct fal_partition *part = emboot_part(emboot_part_backup);
+    uint32_t size;
+    uint32_t from = 0;
+
+    if (EMBOOT_RSM_SIZE == 0 || part == RT_NULL || embrym_rsm_get(0, &size) < 0)
+    {
+        return 0;
+    }
+
+    for (uint32_t index = 0; index < EMBRYM_RSM_NUMS && from + EMBOOT_RSM_CHUNK < size; ++index)
+    {
+        uint32_t data;
+        if (embrym_rsm_get(index + 1, &data) < 0)
+        {
+            break;
+        }
+
+        uint32_t hash = EMBOOT_CRC_INIT;
+        for (uint32_t pos = 0; pos < EMBOOT_RSM_CHUNK; pos += sizeof(emboot_copy_buffer))
+        {
+            emboot_part_read(part, from + pos, emboot_copy_buffer, sizeof(emboot_copy_buffer));
+            hash = embcrc(emboot_copy_buffer, sizeof(emboot_copy_buffer), hash);
+        }
+        if (hash != data)
+        {
+            break;
+        }
+        from += EMBOOT_RSM_CHUNK;
+    }
+
+    uint32_t blks = emboot_lazy_blks(part);
+    return from / blks * blks;
+}
 
 static enum rym_code embrym_recv_bgn(struct rym_ctx *ctx, rt_uint8_t *buf, rt_size_t len)
 {
-    fal_partition_t part = (fal_partition_t)fal_partition_find(EMBOOT_BACKUP_PART);
-    if (part == RT_NULL) return RYM_ERR_CAN;
+    uint32_t size = atoi(1 + (const char *)buf + rt_strnlen((const char *)buf, len - 1));
+    uint32_t logged = 0;
+
+    if (embrym_rsm_from)
+    {
+        // the host has to continue the same package where it was told to.
+        if (embrym_rsm_get(0, &logged) < 0 || logged != embrym_rsm_from + size) return RYM_ERR_CAN;
+    }
+    if (emboot_lazy_init(&embrym_recv_lazy, emboot_part_backup, embrym_rsm_from) < 0) return RYM_ERR_CAN;
+
+    embset_verify_info(0, 0);
 
-    fal_partition_erase_all(part);
+    embrym_recv_idx = embrym_rsm_from;
+    embrym_hash_init();
 
-    embrym_recv_idx = 0;
+    if (embrym_rsm_from)
+    {
+        // the chunks above the resume point are logged again, so the log starts over with the ones below it.
+        embrym_rsm_erase();
+        embrym_rsm_set(0, logged);
+        for (uint32_t pos = 0; pos < embrym_rsm_from; pos += sizeof(emboot_copy_buffer))
+        {
+            emboot_part_read(embrym_recv_lazy.part, pos, emboot_copy_buffer, sizeof(emboot_copy_buffer));
+            embrym_hash_feed(pos, emboot_copy_buffer, sizeof(emboot_copy_buffer));
+            embrym_rsm_feed(pos, emboot_copy_buffer, sizeof(emboot_copy_buffer));
+        }
+    }
+    else
+    if (EMBOOT_RSM_SIZE)
+    {
+        embrym_rsm_erase();
+        if (size)
+        {
+            embrym_rsm_set(0, size);
+        }
+    }
     return RYM_CODE_ACK;
 }
 
+/**
+ * programs received data into [dnload/backup] and reads it back.
+ */
+static int embrym_prog(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    for (uint32_t pos = 0; pos < size; pos += sizeof(emboot_copy_buffer))
+    {
+        uint32_t len = size - pos < sizeof(emboot_copy_buffer) ? size - pos : sizeof(emboot_copy_buffer);
+        if (emboot_lazy_write(&embrym_recv_lazy, addr + pos, data + pos, len) != len) return -1;
+        if (emboot_part_read(embrym_recv_lazy.part, addr + pos, emboot_copy_buffer, len) != len) return -1;
+        if (memcmp(data + pos, emboot_copy_buffer, len) != 0) return -1;
+    }
+    return 0;
+}
+
+static int embrym_recv_prog(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    if (embrym_prog(addr, data, size) < 0) return -1;
+    if (EMBOOT_RSM_SIZE)
+    {
+        embrym_rsm_feed(addr, data, size);
+    }
+    return 0;
+}
+
+#if EMBOOT_RYM_RING
+/**
+ * write-behind: a packet is acknowledged as soon as it is buffered and hashed, the ring thread programs it
+ * while the next packet is on the wire. when all buffers are in use, the acknowledge is held back until one
+ * is free again, which throttles the sender.
+ */
+static unsigned char embrym_ring_data[EMBOOT_RYM_RING][1024];
+static uint32_t embrym_ring_addr[EMBOOT_RYM_RING];
+static uint32_t embrym_ring_size[EMBOOT_RYM_RING];
+static int embrym_ring_head;
+static int embrym_ring_tail;
+static int embrym_ring_fail;
+static int embrym_ring_quit;
+static int embrym_ring_mark;
+static struct rt_semaphore embrym_ring_free;
+static struct rt_semaphore embrym_ring_used;
+static struct rt_semaphore embrym_ring_exit;
+
+static void embrym_ring_entry(void *parameter)
+{
+    while (1)
+    {
+        rt_sem_take(&embrym_ring_used, RT_WAITING_FOREVER);
+        if (embrym_ring_quit)
+        {
+            break;
+        }
+
+        int i = embrym_ring_tail;
+        if (!embrym_ring_fail && embrym_recv_prog(embrym_ring_addr[i], embrym_ring_data[i], embrym_ring_size[i]) < 0)
+        {
+            embrym_ring_fail = 1;
+        }
+        embrym_ring_tail = (i + 1) % EMBOOT_RYM_RING;
+        rt_sem_release(&embrym_ring_free);
+    }
+    rt_sem_release(&embrym_ring_exit);
+}
+
+static int embrym_ring_start(void)
+{
+    embrym_ring_head = 0;
+    embrym_ring_tail = 0;
+    embrym_ring_fail = 0;
+    embrym_ring_quit = 0;
+    rt_sem_init(&embrym_ring_free, "rymfree", EMBOOT_RYM_RING, RT_IPC_FLAG_FIFO);
+    rt_sem_init(&embrym_ring_used, "rymused", 0, RT_IPC_FLAG_FIFO);
+    rt_sem_init(&embrym_ring_exit, "rymexit", 0, RT_IPC_FLAG_FIFO);
+
+    rt_thread_t thread = rt_thread_create("rymring", embrym_ring_entry, RT_NULL, 1024, EMBOOT_RYM_PRIO, 10);
+    if (thread == RT_NULL)
+    {
+        rt_sem_detach(&embrym_ring_free);
+        rt_sem_detach(&embrym_ring_used);
+        rt_sem_detach(&embrym_ring_exit);
+        return -1;
+    }
+    rt_thread_startup(thread);
+    embrym_ring_mark = 1;
+    return 0;
+}
+
+/**
+ * waits until every buffered packet is programmed, then stops the ring thread.
+ */
+static int embrym_ring_stop(void)
+{
+    if (!embrym_ring_mark)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < EMBOOT_RYM_RING; ++i)
+    {
+        rt_sem_take(&embrym_ring_free, RT_WAITING_FOREVER);
+    }
+    embrym_ring_quit = 1;
+    rt_sem_release(&embrym_ring_used);
+    rt_sem_take(&embrym_ring_exit, RT_WAITING_FOREVER);
+
+    rt_sem_detach(&embrym_ring_free);
+    rt_sem_detach(&embrym_ring_used);
+    rt_sem_detach(&embrym_ring_exit);
+    embrym_ring_mark = 0;
+
+    return embrym_ring_fail ? -1 : 0;
+}
+#endif
+
 static enum rym_code embrym_recv_txt(struct rym_ctx *ctx, rt_uint8_t *buf, rt_size_t len)
 {
-    fal_partition_t part = (fal_partition_t)fal_partition_find(EMBOOT_BACKUP_PART);
-    if (part == RT_NULL) return RYM_ERR_CAN;
+#if EMBOOT_RYM_RING
+    if (!embrym_ring_mark && embrym_ring_start() < 0) return RYM_ERR_CAN;
+    if (embrym_ring_fail) return RYM_ERR_CAN;
+    if (rt_sem_take(&embrym_ring_free, EMBOOT_RYM_WAIT) != RT_EOK) return RYM_ERR_CAN;
+
+    int i = embrym_ring_head;
+    memcpy(embrym_ring_data[i], buf, len);
+    embrym_ring_addr[i] = embrym_recv_idx;
+    embrym_ring_size[i] = len;
+    embrym_ring_head = (i + 1) % EMBOOT_RYM_RING;
+    rt_sem_release(&embrym_ring_used);
+#else
+    if (embrym_recv_prog(embrym_recv_idx, buf, len) < 0) return RYM_ERR_CAN;
+#endif
 
-    int writeLen = fal_partition_write(part, embrym_recv_idx, buf, len);
-    if (writeLen != len) return RYM_ERR_CAN;
+    embrym_hash_feed(embrym_recv_idx, buf, len);
 
     embrym_recv_idx += len;
     return RYM_CODE_ACK;
@@ -1346,36 +4465,283 @@ static enum rym_code embrym_recv_txt(struct rym_ctx *ctx, rt_uint8_t *buf, rt_si
 
 static enum rym_code embrym_recv_end(struct rym_ctx *ctx, rt_uint8_t *buf, rt_size_t len)
 {
+#if EMBOOT_RYM_RING
+    if (embrym_ring_stop() < 0) return RYM_ERR_CAN;
+#endif
     return RYM_CODE_ACK;
 }
 
-void embrym_recv(void)
+static int embrym_recv_fini(rt_err_t result);
+
+/**
+ * receives a package over ymodem on the given device into [dnload/backup].
+ * resume: keeps what the progress log proves to be received and tells the host on dev where to continue,
+ * "resume at <offset>\n", the host then sends the rest of the package as a file of its own.
+ */
+int embrym_recv_on(rt_device_t dev, int resume)
 {
-    rt_device_t dev = rt_console_get_device();
-    if (!dev) return;
+    struct rym_ctx ctx;
 
-    shell_printf("press 'u' to abort\n");
+    embrym_rsm_from = resume ? embrym_rsm_scan() : 0;
+    if (resume)
+    {
+        char line[32];
+        int size = rt_snprintf(line, sizeof(line), "resume at %u\n", embrym_rsm_from);
+        rt_device_write(dev, 0, line, size);
+    }
 
-    struct rym_ctx ctx;
     rt_err_t result = rym_recv_on_device(&ctx, dev, RT_DEVICE_OFLAG_RDWR | RT_DEVICE_FLAG_RX_NON_BLOCKING,
                                          embrym_recv_bgn,
                                          embrym_recv_txt,
                                          embrym_recv_end, 1000);
+#if EMBOOT_RYM_RING
+    if (embrym_ring_stop() < 0)
+    {
+        result = -RT_ERROR;
+    }
+#endif
+
+    return embrym_recv_fini(result);
+}
+
+/**
+ * windowed download, "download -w": the host keeps up to EMBOOT_WIN_NUMS frames in flight and resends only
+ * the ones that are not acknowledged. all fields are little endian.
+ *
+ * frame: 0xA5 0x5A | type | 0x00 | len (16) | index (32) | payload[len] | crc32 (from type to the end of payload)
+ *
+ * device -> host: 'R' ready  (payload: window, frame size), repeated until the host says hello
+ *                 'S' status (index: first missing frame, payload: bitmap of the frames index + 1 .. index + 32)
+ *                 'C' cancel
+ * host -> device: 'H' hello  (payload: package size)
+ *                 'D' data   (index: offset / frame size)
+ *                 'E' end
+ */
+#define EMBWIN_HEAD                     10
+
+static unsigned char embwin_frame[EMBWIN_HEAD + EMBOOT_WIN_FRAME + 4];
+static struct rt_semaphore embwin_rx_sem;
+
+static rt_err_t embwin_rx_ind(rt_device_t dev, rt_size_t size)
+{
+    rt_sem_release(&embwin_rx_sem);
+    return RT_EOK;
+}
+
+static int embwin_read(rt_device_t dev, uint8_t *buf, int size)
+{
+    int got = 0;
+    while (got < size)
+    {
+        int len = rt_device_read(dev, 0, buf + got, size - got);
+        if (len > 0)
+        {
+            got += len;
+        }
+        else
+        if (rt_sem_take(&embwin_rx_sem, EMBOOT_WIN_WAIT) != RT_EOK)
+        {
+            return -1;
+        }
+    }
+    return got;
+}
+
+static void embwin_send(rt_device_t dev, uint8_t type, uint32_t index, const void *data, uint16_t len)
+{
+    uint8_t frame[EMBWIN_HEAD + 8 + 4] = {0xA5, 0x5A, type, 0x00};
+
+    memcpy(&frame[4], &len, 2);
+    memcpy(&frame[6], &index, 4);
+    if (len)
+    {
+        memcpy(&frame[EMBWIN_HEAD], data, len);
+    }
+    uint32_t crc = embcrc(&frame[2], EMBWIN_HEAD - 2 + len, EMBOOT_CRC_INIT);
+    memcpy(&frame[EMBWIN_HEAD + len], &crc, 4);
+    rt_device_write(dev, 0, frame, EMBWIN_HEAD + len + 4);
+}
+
+/**
+ * return: frame type, 0 if the frame is corrupted, -1 on timeout.
+ */
+static int embwin_recv_frame(rt_device_t dev, uint32_t *index, uint16_t *len)
+{
+    uint8_t *frame = embwin_frame;
+    uint8_t last = 0;
+    uint32_t crc;
+
+    frame[1] = 0;
+    do
+    {
+        last = frame[1];
+        if (embwin_read(dev, &frame[1], 1) < 0) return -1;
+    } while (last != 0xA5 || frame[1] != 0x5A);
+
+    if (embwin_read(dev, &frame[2], EMBWIN_HEAD - 2) < 0) return -1;
+    memcpy(len, &frame[4], 2);
+    memcpy(index, &frame[6], 4);
+    if (*len > EMBOOT_WIN_FRAME) return 0;
+
+    if (embwin_read(dev, &frame[EMBWIN_HEAD], *len + 4) < 0) return -1;
+    memcpy(&crc, &frame[EMBWIN_HEAD + *len], 4);
+    if (crc != embcrc(&frame[2], EMBWIN_HEAD - 2 + *len, EMBOOT_CRC_INIT)) return 0;
+
+    return frame[2];
+}
+
+int embwin_recv_on(rt_device_t dev)
+{
+    rt_err_t (*rx_ind)(rt_device_t dev, rt_size_t size) = dev->rx_indicate;
+    rt_uint16_t flag = dev->open_flag;
+    uint32_t size = 0;                                      // 0 until the host said hello
+    uint32_t base = 0;
+    uint32_t bitmap = 0;
+    uint32_t index;
+    uint16_t len;
+    int idle = 0;
+    rt_err_t result = -RT_ERROR;
+
+    rt_sem_init(&embwin_rx_sem, "embwin", 0, RT_IPC_FLAG_FIFO);
+    rt_device_set_rx_indicate(dev, embwin_rx_ind);
+    dev->open_flag &= ~RT_DEVICE_FLAG_STREAM;               // binary frames, no "\n" -> "\r\n"
+    rt_device_open(dev, RT_DEVICE_OFLAG_RDWR | RT_DEVICE_FLAG_RX_NON_BLOCKING);
+
+    while (idle < 10)
+    {
+        if (size == 0)
+        {
+            uint32_t ready[2] = {EMBOOT_WIN_NUMS, EMBOOT_WIN_FRAME};
+            embwin_send(dev, 'R', 0, ready, sizeof(ready));
+        }
+
+        int type = embwin_recv_frame(dev, &index, &len);
+        if (type < 0)
+        {
+            idle++;
+            if (size)
+            {
+                embwin_send(dev, 'S', base, &bitmap, 4);
+            }
+            continue;
+        }
+        idle = 0;
 
+        uint8_t *data = &embwin_frame[EMBWIN_HEAD];
+        if (type == 'H' && len == 4 && size == 0)
+        {
+            memcpy(&size, data, 4);
+            if (size == 0 || emboot_lazy_init(&embrym_recv_lazy, emboot_part_backup, 0) < 0 || size > embrym_recv_lazy.part->len)
+            {
+                embwin_send(dev, 'C', 0, RT_NULL, 0);
+                break;
+            }
+            embset_verify_info(0, 0);
+            embrym_rsm_erase();                             // frames may arrive out of order, no chunk log
+            embrym_hash_init();
+        }
+        else
+        if (type == 'D' && size && index >= base && index - base < EMBOOT_WIN_NUMS)
+        {
+            uint32_t addr = index * EMBOOT_WIN_FRAME;
+            uint32_t mask = index > base ? 1u << (index - base - 1) : 0;
+            if (index == base || !(bitmap & mask))
+            {
+                if (addr + len > size || embrym_prog(addr, data, len) < 0)
+                {
+                    embwin_send(dev, 'C', index, RT_NULL, 0);
+                    break;
+                }
+                embrym_hash_feed(addr, data, len);          // out of order frames leave the package to be hashed by the precheck
+
+                if (index == base)
+                {
+                    base++;
+                    while (bitmap & 1)
+                    {
+                        bitmap >>= 1;
+                        base++;
+                    }
+                    bitmap >>= 1;
+                }
+                else
+                {
+                    bitmap |= mask;
+                }
+            }
+        }
+        else
+        if (type == 'E' && size && base * EMBOOT_WIN_FRAME >= size)
+        {
+            embwin_send(dev, 'S', base, &bitmap, 4);
+            result = RT_EOK;
+            break;
+        }
+
+        if (size)
+        {
+            embwin_send(dev, 'S', base, &bitmap, 4);
+        }
+    }
+
+    rt_device_close(dev);
+    dev->open_flag = flag;
+    rt_device_set_rx_indicate(dev, rx_ind);
+    rt_sem_detach(&embwin_rx_sem);
+
+    return embrym_recv_fini(result);
+}
+
+/**
+ * common tail of both transports.
+ */
+static int embrym_recv_fini(rt_err_t result)
+{
     shell_printf("\ndownload ");
     if (result != RT_EOK)
     {
         shell_printf("fail!\n");
+        return -1;
+    }
+
+    shell_printf("success!\n");
+    if (emboot_verify_precheck() != 0)
+    {
+        embrym_rsm_erase();
     }
     else
     {
-        shell_printf("success!\n");
-        if (emboot_verify_precheck() == 0)
+        emboot_head_t *emboot_head = (emboot_head_t *)emboot_head_buffer;
+        emboot_upctrl_reset();
+        emboot_ctrl_begin();
+        embset_update_step(emboot_step_verify, 0);
+        if (embrym_hash_done(emboot_head))
         {
-            emboot_upctrl_erase();
-            embset_update_step(emboot_step_verify, 0);
+            embset_verify_info(emboot_head->header_size + emboot_head->remain_size, emboot_head->remain_hash);
         }
+        emboot_ctrl_commit();
     }
+    return 0;
+}
+
+void embrym_recv(int resume)
+{
+    rt_device_t dev = rt_console_get_device();
+    if (!dev) return;
+
+    shell_printf("press 'u' to abort\n");
+
+    embrym_recv_on(dev, resume);
+}
+
+void embwin_recv(void)
+{
+    rt_device_t dev = rt_console_get_device();
+    if (!dev) return;
+
+    shell_printf("start the windowed sender\n");
+
+    embwin_recv_on(dev);
 }
 
 void embcmd_reboot(char argc, char *argv)
@@ -1394,8 +4760,21 @@ void embcmd_jump(char argc, char *argv)
     }
 }
 
+static int embcmd_busy(void)
+{
+    if (emboot_job)
+    {
+        emboot_printf_i("busy, an update is running!\n");
+    }
+    return emboot_job;
+}
+
 void embcmd_redo(char argc, char *argv)
 {
+    if (embcmd_busy())
+    {
+        return;
+    }
     if (argc == 1)
     {
         embset_update_step(emboot_step_recopy, 1);
@@ -1409,6 +4788,10 @@ void embcmd_redo(char argc, char *argv)
 
 void embcmd_undo(char argc, char *argv)
 {
+    if (embcmd_busy())
+    {
+        return;
+    }
     if (argc == 1)
     {
         embset_update_step(emboot_step_revert, 1);
@@ -1417,9 +4800,23 @@ void embcmd_undo(char argc, char *argv)
 
 void embcmd_download(char argc, char *argv)
 {
+    if (embcmd_busy())
+    {
+        return;
+    }
     if (argc == 1)
     {
-        embrym_recv();
+        embrym_recv(0);
+    }
+    else
+    if (argc == 2 && !strcmp("-c", &argv[(int)argv[1]]))
+    {
+        embrym_recv(1);
+    }
+    else
+    if (argc == 2 && !strcmp("-w", &argv[(int)argv[1]]))
+    {
+        embwin_recv();
     }
 }
 
@@ -8,6 +8,7 @@
 #define __emboot_h__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef enum emboot_stat_t
@@ -39,8 +40,41 @@ typedef struct emboot_ctrl_t
     uint32_t backup_hash;
     uint32_t decode_size;
     uint32_t decode_hash;
+    uint32_t verify_size;           // "verified package" token, written by the download after hashing the package on receive.
+    uint32_t verify_hash;
+    uint32_t verify_mark;
+    uint32_t slot_flip;             // A/B slot mode: the active slot is the parity of the cleared bits, 0: [curent/runapp], 1: [decode/newapp].
+    uint32_t slot_size[2];          // A/B slot mode: image in each slot.
+    uint32_t slot_hash[2];
 } emboot_ctrl_t;
 
+/**
+ * [upctrl] keeps emboot_ctrl_t in a journal: every change appends a record, the last one with a good crc holds.
+ * by default the journal takes the top two sectors of [upctrl] (__update_zone_size), the logs are sized to fit below.
+ * emboot_ctrl_map finds it in the memory mapped [upctrl] (also before anything is initialized), RT_NULL if none.
+ * an emboot_ctrl_t that an application programs at [upctrl:0] (as before the journal) is a request: its words other
+ * than 0xFFFFFFFF replace the journaled ones, once emboot imports it into the journal (emboot_ctrl_map shows it merged).
+ */
+typedef struct emboot_jrec_t
+{
+    uint32_t seq;                   // sequence number, 0xFFFFFFFF: free slot
+    emboot_ctrl_t ctrl;
+    uint32_t rsvd;                  // 0xFFFFFFFF, pads the record to a multiple of 8 bytes
+    uint32_t crc;                   // CRC-32/MPEG-2 of all the fields above
+} emboot_jrec_t;
+
+const emboot_ctrl_t *emboot_ctrl_map(void);
+
+typedef struct emboot_read_stat_t
+{
+    uint32_t old_hits;              // old image cache, in lines
+    uint32_t old_misses;
+    uint32_t old_direct;            // reads of a line or more, passed to flash
+    uint32_t patch_hits;            // patch stream read-ahead, in reads (or parts of reads)
+    uint32_t patch_fills;
+    uint32_t patch_direct;
+} emboot_read_stat_t;
+
 typedef enum patchi_type_t
 {
     patchi_type_full_image = 0xFFFFFFFF,
@@ -64,6 +98,11 @@ typedef struct patchi_data_t
 
 } patchi_data_t;
 
+/**
+ * the optional block manifest is an array of the crcs of every block of the new image (each from the crc init value,
+ * the last block may be short). it sits inside the header, so header_hash covers it and it moves to [upctrl] with
+ * the header. verifies stop at the first bad block, and a failed copy only rewrites the bad blocks.
+ */
 typedef struct emboot_head_t
 {
     uint32_t                            header_size;
@@ -76,9 +115,9 @@ typedef struct emboot_head_t
     uint32_t                            patchx_size;
     uint32_t                            patchx_nums;
 
-    uint32_t                            Reserved_C1;
-    uint32_t                            Reserved_C2;
-    uint32_t                            Reserved_C3;
+    uint32_t                            Reserved_C1;        // block manifest: bytes per block (a power of 2), 0 or 0xFFFFFFFF: none
+    uint32_t                            Reserved_C2;        // block manifest: offset in the header (behind patchx_data)
+    uint32_t                            Reserved_C3;        // block manifest: number of blocks
     uint32_t                            Reserved_C4;
 
     uint32_t                            Reserved_D1;
@@ -90,11 +129,95 @@ typedef struct emboot_head_t
 
 } emboot_head_t;
 
+/**
+ * hash engine used for the image hashes (CRC-32/MPEG-2).
+ * final() returns the running value and may be called at any time without ending the calculation.
+ */
+typedef struct emboot_hash_t
+{
+    void                              (*init)  (void);
+    void                              (*update)(const uint8_t *data, size_t size);
+    uint32_t                          (*final) (void);
+
+} emboot_hash_t;
+
+extern const emboot_hash_t emboot_hash_soft;
+
+void emboot_hash_set(const emboot_hash_t *hash);
+
+/**
+ * blank check: returns how many bytes from addr on (at most size) are known to be erased, without reading them,
+ * e.g. from a hardware blank check or a bitmap of the sectors erased since boot. 0 if unknown.
+ * such runs are hashed by crc algebra instead of being read, and are not copied between erased partitions.
+ */
+struct fal_partition;
+typedef uint32_t (*emboot_blank_t)(const struct fal_partition *part, uint32_t addr, uint32_t size);
+
+void emboot_blank_set(emboot_blank_t blank);
+
+/**
+ * memory mapped partitions (internal flash): set this bit in the reserved word of the fal partition table entry, the
+ * partition is then read at flash device addr + partition offset. hashes and compares run straight on the mapping,
+ * and copies program straight from it, so the flash driver must take a source buffer in mapped flash.
+ * emboot_mmap_set replaces the lookup, e.g. for a mapping at another address. RT_NULL: not mapped.
+ */
+#define EMBOOT_PART_MMAP                0x00000001
+
+typedef const uint8_t *(*emboot_mmap_t)(const struct fal_partition *part);
+
+void emboot_mmap_set(emboot_mmap_t mmap);
+
+/**
+ * asynchronous partition i/o (optional): read and write start an operation and return at once, done(arg, result)
+ * reports its end with the result the fal call would have. done may run in an interrupt, in another thread, inside
+ * read/write, or inside idle, which emboot calls while it waits (RT_NULL: spin). operations on one device run in
+ * the order they were started. read/write return < 0 if the operation could not be started (done is not called),
+ * emboot then makes the fal call itself. the copies and the hashes read ahead and program behind in EMBOOT_AIO_BUFS
+ * buffers. emboot_aio_sync makes the fal calls in place, for flash drivers without asynchronous operations.
+ * RT_NULL: synchronous i/o.
+ */
+typedef void (*emboot_aio_done_t)(void *arg, int result);
+
+typedef struct emboot_aio_t
+{
+    int                               (*read) (const struct fal_partition *part, uint32_t addr, uint8_t *buf, size_t size, emboot_aio_done_t done, void *arg);
+    int                               (*write)(const struct fal_partition *part, uint32_t addr, const uint8_t *buf, size_t size, emboot_aio_done_t done, void *arg);
+    void                              (*idle) (void);
+
+} emboot_aio_t;
+
+extern const emboot_aio_t emboot_aio_sync;
+
+void emboot_aio_set(const emboot_aio_t *aio);
+
 void emboot_core(void);
 void emboot_loop(void);
 void emboot_tick(void);
 void emboot_fast_boot(void);
 
+/**
+ * the update steps, the control block and the statistics, for the shell commands and the host simulator.
+ */
+struct rt_device;
+
+int emboot_update(void);
+int emboot_verify_precheck(void);
+int emboot_upctrl_reset(void);
+void emboot_ctrl_drop(void);
+int embget_update_step(void);
+int embset_update_step(emboot_step_t step, int erase);
+int embget_update_stay(void);
+int embget_boot_slot(void);                                 // A/B slot mode only
+void embget_sync_stat(uint32_t *skipped, uint32_t *rewritten);
+void embget_read_stat(emboot_read_stat_t *stat);
+uint32_t embget_slice_stat(void);
+int embrym_recv_on(struct rt_device *dev, int resume);
+int embwin_recv_on(struct rt_device *dev);
+
+uint32_t embcrc(const uint8_t *data, size_t len, uint32_t crc);
+uint32_t embcrc_ones(uint32_t crc, size_t len);
+uint32_t embcrc_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b);
+
 
 #define __MONH__    ((__DATE__[0]+__DATE__[1]+__DATE__[2]) == 281 ? '0' \
                     :(__DATE__[0]+__DATE__[1]+__DATE__[2]) == 269 ? '0' \
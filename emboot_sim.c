@@ -0,0 +1,1989 @@
+/**
+ * Copyright (c) 2024, liujitong, <sulfurandcu@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// host simulator: file backed nor flash for fal + update benchmark.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE                                         // posix_openpt, cfmakeraw
+#endif
+
+#include <rtconfig.h>
+#include <rtthread.h>
+
+#include <emboot.h>
+#include <emboot_sim.h>
+#include <fal.h>
+#include <nr_micro_shell.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+//                                      name           len                 blk_size  page  gran  read_op_ns  read_ns  prog_us  erase_us
+embsim_flash_t embsim_update        = {"sim_update", EMBSIM_UPDATE_SIZE,   2048,     8,    64,   0,          1,       82,      22000};
+embsim_flash_t embsim_runapp        = {"sim_runapp", EMBSIM_RUNAPP_SIZE,   2048,     8,    64,   0,          1,       82,      22000};
+embsim_flash_t embsim_backup        = {"sim_backup", EMBSIM_BACKUP_SIZE,   4096,     256,  1,    2000,       400,     700,     45000};
+embsim_flash_t embsim_decode        = {"sim_decode", EMBSIM_DECODE_SIZE,   4096,     256,  1,    2000,       400,     700,     45000};
+embsim_flash_t embsim_scratch       = {"sim_scratch", EMBSIM_SCRATCH_SIZE, 4096,     256,  1,    2000,       400,     700,     45000};
+
+static embsim_flash_t *const embsim_flash[] =
+{
+    &embsim_update,
+    &embsim_runapp,
+    &embsim_backup,
+    &embsim_decode,
+    &embsim_scratch,
+};
+
+int embsim_realtime = EMBSIM_REALTIME;
+
+static uint32_t embsim_cut_left;                            // program/erase operations until the power cut, 0: never
+static jmp_buf embsim_cut_jmp;
+
+static uint32_t embsim_weak_left;                           // program operations on the image partitions until a weak write, 0: never
+static uint32_t embsim_weak_step;                           // update step at the weak write
+
+/**
+ * the cut operation gets half way (the first half of its bytes), then the "power" is gone.
+ */
+static int embsim_cut_hit(void)
+{
+    return embsim_cut_left && --embsim_cut_left == 0;
+}
+
+/**
+ * asynchronous i/o: every flash model has a worker thread that runs the operations started on it in order. the time
+ * an operation ends is modelled when the worker runs it, from the time it was started and the time its device gets
+ * free, and it is reported in the order of these times. synchronous operations wait for the device, the clock is the
+ * modelled time the cpu has waited for the flash so far (cpu time is not modelled).
+ */
+#define EMBSIM_AIO_OPS                  8                   // operations in flight, all devices together
+
+typedef enum embsim_aio_state_t
+{
+    embsim_aio_free,
+    embsim_aio_queued,
+    embsim_aio_running,
+    embsim_aio_executed,
+} embsim_aio_state_t;
+
+typedef struct embsim_aio_op_t
+{
+    embsim_flash_t                     *flash;
+    long                                offset;
+    uint8_t                            *rd_buf;             // a read, else a program from wr_buf
+    const uint8_t                      *wr_buf;
+    size_t                              size;
+    emboot_aio_done_t                   done;
+    void                               *arg;
+    uint32_t                            seq;                // start order
+    uint64_t                            at_ns;              // modelled time it was started
+    uint64_t                            end_ns;             // modelled time it ends
+    int                                 result;
+    embsim_aio_state_t                  state;
+} embsim_aio_op_t;
+
+static embsim_aio_op_t embsim_aio_ops[EMBSIM_AIO_OPS];
+static uint32_t embsim_aio_seq;
+static pthread_mutex_t embsim_aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t embsim_aio_cond = PTHREAD_COND_INITIALIZER;
+static __thread embsim_aio_op_t *embsim_aio_cur;            // the operation the worker thread runs
+
+static uint64_t embsim_clock_ns;
+
+static uint64_t embsim_clock_us(void)
+{
+    pthread_mutex_lock(&embsim_aio_lock);
+    uint64_t now = embsim_clock_ns;
+    pthread_mutex_unlock(&embsim_aio_lock);
+    return now / 1000;
+}
+
+/**
+ * a synchronous operation waits until the operations started on the device have run.
+ */
+static void embsim_aio_drain(embsim_flash_t *flash)
+{
+    if (embsim_aio_cur)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&embsim_aio_lock);
+    for (int i = 0; i < EMBSIM_AIO_OPS; ++i)
+    {
+        while (embsim_aio_ops[i].flash == flash && (embsim_aio_ops[i].state == embsim_aio_queued || embsim_aio_ops[i].state == embsim_aio_running))
+        {
+            pthread_cond_wait(&embsim_aio_cond, &embsim_aio_lock);
+        }
+    }
+    pthread_mutex_unlock(&embsim_aio_lock);
+}
+
+static void embsim_busy(embsim_flash_t *flash, uint64_t ns)
+{
+    pthread_mutex_lock(&embsim_aio_lock);
+    flash->stat.busy_ns += ns;
+
+    uint64_t at = embsim_aio_cur ? embsim_aio_cur->at_ns : embsim_clock_ns;
+    flash->free_ns = (at > flash->free_ns ? at : flash->free_ns) + ns;
+    if (embsim_aio_cur)
+    {
+        embsim_aio_cur->end_ns = flash->free_ns;
+    }
+    else
+    {
+        embsim_clock_ns = flash->free_ns;
+    }
+    pthread_mutex_unlock(&embsim_aio_lock);
+
+    if (embsim_realtime && ns >= 1000)
+    {
+        struct timespec ts = {ns / 1000000000, ns % 1000000000};
+        nanosleep(&ts, RT_NULL);
+    }
+}
+
+static int embsim_open(embsim_flash_t *flash)
+{
+    if (flash->mem)
+    {
+        return 0;
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s.bin", EMBSIM_FLASH_DIR, flash->name);
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        rt_kprintf("embsim: open %s failed!\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    int blank = st.st_size < flash->len;
+    if (blank && ftruncate(fd, flash->len) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    flash->mem = mmap(RT_NULL, flash->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (flash->mem == MAP_FAILED)
+    {
+        flash->mem = RT_NULL;
+        return -1;
+    }
+
+    if (blank)
+    {
+        memset(flash->mem + st.st_size, 0xFF, flash->len - st.st_size);
+    }
+    return 0;
+}
+
+static int embsim_read(embsim_flash_t *flash, long offset, uint8_t *buf, size_t size)
+{
+    if (offset < 0 || offset + size > flash->len) return -1;
+
+    embsim_aio_drain(flash);
+
+    memcpy(buf, flash->mem + offset, size);
+
+    flash->stat.rd_bytes += size;
+    flash->stat.rd_count += 1;
+    embsim_busy(flash, flash->read_op_ns + (uint64_t)flash->read_ns * size);
+    return size;
+}
+
+static int embsim_write(embsim_flash_t *flash, long offset, const uint8_t *buf, size_t size)
+{
+    if (offset < 0 || offset + size > flash->len) return -1;
+    if (size == 0) return 0;
+
+    embsim_aio_drain(flash);
+
+    size_t gran = flash->write_gran > 8 ? flash->write_gran / 8 : 1;
+    if (offset % gran || size % gran)
+    {
+        flash->stat.wr_unaligned++;
+    }
+
+    int cut = embsim_cut_hit();
+    if (cut)
+    {
+        size /= 2;
+    }
+
+    // a weak write: the first bit the operation should clear stays set.
+    int weak = flash != &embsim_update && embsim_weak_left && --embsim_weak_left == 0;
+    if (weak)
+    {
+        const emboot_ctrl_t *ctrl = emboot_ctrl_map();
+        embsim_weak_step = ctrl ? ctrl->update_step : -1;
+    }
+
+    int dirty = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        uint8_t *cell = flash->mem + offset + i;
+        uint8_t data = buf[i];
+        if ((*cell & data) != data)
+        {
+            dirty = 1;
+        }
+        if (weak && (*cell & ~data) != 0)
+        {
+            data |= (*cell & ~data) & -(*cell & ~data);
+            weak = 0;
+        }
+        *cell &= data;                                      // nor flash can only clear bits
+    }
+    flash->stat.wr_dirty += dirty;
+
+    size_t pages = (offset + size - 1) / flash->page_size - offset / flash->page_size + 1;
+    flash->stat.wr_bytes += size;
+    flash->stat.wr_count += 1;
+    embsim_busy(flash, (uint64_t)pages * flash->prog_us * 1000);
+    if (cut)
+    {
+        longjmp(embsim_cut_jmp, 1);
+    }
+    return size;
+}
+
+static int embsim_erase(embsim_flash_t *flash, long offset, size_t size)
+{
+    if (offset < 0 || offset + size > flash->len) return -1;
+    if (size == 0) return 0;
+
+    embsim_aio_drain(flash);
+
+    size_t bgn = offset / flash->blk_size * flash->blk_size;
+    size_t end = (offset + size + flash->blk_size - 1) / flash->blk_size * flash->blk_size;
+    if (embsim_cut_hit())
+    {
+        memset(flash->mem + bgn, 0xFF, (end - bgn) / 2);
+        longjmp(embsim_cut_jmp, 1);
+    }
+    memset(flash->mem + bgn, 0xFF, end - bgn);
+
+    size_t blks = (end - bgn) / flash->blk_size;
+    flash->stat.er_bytes += end - bgn;
+    flash->stat.er_count += blks;
+    embsim_busy(flash, (uint64_t)blks * flash->erase_us * 1000);
+    return size;
+}
+
+/**
+ * hardware blank check, modelled as fast as reading 8 bytes per cycle. answers the leading erased bytes.
+ */
+static uint32_t embsim_blank(const struct fal_partition *part, uint32_t addr, uint32_t size)
+{
+    for (int i = 0; i < sizeof(embsim_flash) / sizeof(embsim_flash[0]); ++i)
+    {
+        embsim_flash_t *flash = embsim_flash[i];
+        if (strcmp(flash->name, part->flash_name) != 0 || flash->mem == RT_NULL)
+        {
+            continue;
+        }
+
+        uint32_t bgn = part->offset + addr;
+        if (bgn >= flash->len)
+        {
+            return 0;
+        }
+        embsim_aio_drain(flash);
+        size = size < flash->len - bgn ? size : flash->len - bgn;
+
+        uint32_t run = 0;
+        while (run < size && flash->mem[bgn + run] == 0xFF)
+        {
+            run++;
+        }
+        embsim_busy(flash, flash->read_op_ns + (uint64_t)flash->read_ns * (run + 1) / 8);
+        return run;
+    }
+    return 0;
+}
+
+/**
+ * the internal flash models are memory mapped. reads through the mapping are cpu loads, they do not show up in the
+ * flash statistics (an internal flash read costs about as much).
+ */
+static const uint8_t *embsim_mmap(const struct fal_partition *part)
+{
+    if (strcmp(part->flash_name, embsim_update.name) == 0 && embsim_update.mem)
+    {
+        return embsim_update.mem + part->offset;
+    }
+    if (strcmp(part->flash_name, embsim_runapp.name) == 0 && embsim_runapp.mem)
+    {
+        return embsim_runapp.mem + part->offset;
+    }
+    return RT_NULL;
+}
+
+static int embsim_attach(embsim_flash_t *flash, struct fal_flash_dev *dev)
+{
+    dev->blk_size   = flash->blk_size;
+    dev->write_gran = flash->write_gran;
+    return embsim_open(flash);
+}
+
+#define EMBSIM_FLASH_DEV(part, plen) \
+    static int embsim_##part##_init (void); \
+    static int embsim_##part##_read (long offset, uint8_t *buf, size_t size)       { return embsim_read (&embsim_##part, offset, buf, size); } \
+    static int embsim_##part##_write(long offset, const uint8_t *buf, size_t size) { return embsim_write(&embsim_##part, offset, buf, size); } \
+    static int embsim_##part##_erase(long offset, size_t size)                     { return embsim_erase(&embsim_##part, offset, size); } \
+    struct fal_flash_dev embsim_##part##_dev = \
+    { \
+        .name       = "sim_" #part, \
+        .addr       = 0, \
+        .len        = plen, \
+        .ops        = {embsim_##part##_init, embsim_##part##_read, embsim_##part##_write, embsim_##part##_erase}, \
+    }; \
+    static int embsim_##part##_init (void)                                        { return embsim_attach(&embsim_##part, &embsim_##part##_dev); }
+
+EMBSIM_FLASH_DEV(update, EMBSIM_UPDATE_SIZE)
+EMBSIM_FLASH_DEV(runapp, EMBSIM_RUNAPP_SIZE)
+EMBSIM_FLASH_DEV(backup, EMBSIM_BACKUP_SIZE)
+EMBSIM_FLASH_DEV(decode, EMBSIM_DECODE_SIZE)
+EMBSIM_FLASH_DEV(scratch, EMBSIM_SCRATCH_SIZE)
+
+static embsim_flash_t *embsim_flash_of(const struct fal_partition *part)
+{
+    for (int i = 0; i < sizeof(embsim_flash) / sizeof(embsim_flash[0]); ++i)
+    {
+        if (strcmp(embsim_flash[i]->name, part->flash_name) == 0 && embsim_flash[i]->mem)
+        {
+            return embsim_flash[i];
+        }
+    }
+    return RT_NULL;
+}
+
+static void *embsim_aio_entry(void *parameter)
+{
+    embsim_flash_t *flash = parameter;
+
+    pthread_mutex_lock(&embsim_aio_lock);
+    for (;;)
+    {
+        embsim_aio_op_t *op = RT_NULL;
+        for (int i = 0; i < EMBSIM_AIO_OPS; ++i)
+        {
+            embsim_aio_op_t *it = &embsim_aio_ops[i];
+            if (it->flash == flash && it->state == embsim_aio_queued && (op == RT_NULL || (int32_t)(it->seq - op->seq) < 0))
+            {
+                op = it;
+            }
+        }
+        if (op == RT_NULL)
+        {
+            pthread_cond_wait(&embsim_aio_cond, &embsim_aio_lock);
+            continue;
+        }
+
+        op->state = embsim_aio_running;
+        pthread_mutex_unlock(&embsim_aio_lock);
+
+        embsim_aio_cur = op;
+        int result = op->rd_buf ? embsim_read(flash, op->offset, op->rd_buf, op->size) : embsim_write(flash, op->offset, op->wr_buf, op->size);
+        embsim_aio_cur = RT_NULL;
+
+        pthread_mutex_lock(&embsim_aio_lock);
+        op->result = result;
+        op->state = embsim_aio_executed;
+        pthread_cond_broadcast(&embsim_aio_cond);
+    }
+    return RT_NULL;
+}
+
+static int embsim_aio_start(const struct fal_partition *part, uint32_t addr, uint8_t *rd_buf, const uint8_t *wr_buf, size_t size, emboot_aio_done_t done, void *arg)
+{
+    embsim_flash_t *flash = embsim_flash_of(part);
+    if (flash == RT_NULL)
+    {
+        return -1;
+    }
+    if (addr + size > part->len)
+    {
+        done(arg, -1);
+        return 0;
+    }
+
+    // injected faults longjmp out of emboot, they must hit in the thread of emboot.
+    if (embsim_cut_left || embsim_weak_left)
+    {
+        done(arg, rd_buf ? embsim_read(flash, part->offset + addr, rd_buf, size) : embsim_write(flash, part->offset + addr, wr_buf, size));
+        return 0;
+    }
+
+    pthread_mutex_lock(&embsim_aio_lock);
+    embsim_aio_op_t *op = RT_NULL;
+    for (int i = 0; i < EMBSIM_AIO_OPS && op == RT_NULL; ++i)
+    {
+        op = embsim_aio_ops[i].state == embsim_aio_free ? &embsim_aio_ops[i] : RT_NULL;
+    }
+    if (op)
+    {
+        *op = (embsim_aio_op_t){flash, part->offset + addr, rd_buf, wr_buf, size, done, arg, embsim_aio_seq++, embsim_clock_ns, 0, 0, embsim_aio_queued};
+        pthread_cond_broadcast(&embsim_aio_cond);
+    }
+    pthread_mutex_unlock(&embsim_aio_lock);
+    return op ? 0 : -1;
+}
+
+static int embsim_aio_read(const struct fal_partition *part, uint32_t addr, uint8_t *buf, size_t size, emboot_aio_done_t done, void *arg)
+{
+    return embsim_aio_start(part, addr, buf, RT_NULL, size, done, arg);
+}
+
+static int embsim_aio_write(const struct fal_partition *part, uint32_t addr, const uint8_t *buf, size_t size, emboot_aio_done_t done, void *arg)
+{
+    return embsim_aio_start(part, addr, RT_NULL, buf, size, done, arg);
+}
+
+/**
+ * reports the operation that ends first, once all of them have run (one still running might end earlier).
+ */
+static void embsim_aio_idle(void)
+{
+    embsim_aio_op_t *op;
+
+    pthread_mutex_lock(&embsim_aio_lock);
+    for (;;)
+    {
+        int running = 0;
+        op = RT_NULL;
+        for (int i = 0; i < EMBSIM_AIO_OPS; ++i)
+        {
+            embsim_aio_op_t *it = &embsim_aio_ops[i];
+            running |= it->state == embsim_aio_queued || it->state == embsim_aio_running;
+            if (it->state == embsim_aio_executed && (op == RT_NULL || it->end_ns < op->end_ns))
+            {
+                op = it;
+            }
+        }
+        if (!running)
+        {
+            break;
+        }
+        pthread_cond_wait(&embsim_aio_cond, &embsim_aio_lock);
+    }
+
+    emboot_aio_done_t done = RT_NULL;
+    void *arg = RT_NULL;
+    int result = 0;
+    if (op)
+    {
+        embsim_clock_ns = op->end_ns > embsim_clock_ns ? op->end_ns : embsim_clock_ns;
+        done = op->done;
+        arg = op->arg;
+        result = op->result;
+        op->state = embsim_aio_free;
+    }
+    pthread_mutex_unlock(&embsim_aio_lock);
+
+    if (done)
+    {
+        done(arg, result);
+    }
+}
+
+static const emboot_aio_t embsim_aio =
+{
+    embsim_aio_read,
+    embsim_aio_write,
+    embsim_aio_idle,
+};
+
+static int embsim_aio_init(void)
+{
+    static int started;
+    if (started)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < sizeof(embsim_flash) / sizeof(embsim_flash[0]); ++i)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, RT_NULL, embsim_aio_entry, embsim_flash[i]) != 0)
+        {
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    started = 1;
+    return 0;
+}
+
+/**
+ * maps every flash file, must run before emboot_fast_boot() which reads [upctrl] and [runapp] directly.
+ */
+int embsim_init(void)
+{
+    if (embsim_update_init() < 0) return -1;
+    if (embsim_runapp_init() < 0) return -1;
+    if (embsim_backup_init() < 0) return -1;
+    if (embsim_decode_init() < 0) return -1;
+    if (embsim_scratch_init() < 0) return -1;
+#if EMBSIM_BLANK_CHECK
+    emboot_blank_set(embsim_blank);
+#endif
+#if EMBSIM_MMAP
+    emboot_mmap_set(embsim_mmap);
+#endif
+#if EMBSIM_AIO
+    if (embsim_aio_init() < 0) return -1;
+    emboot_aio_set(&embsim_aio);
+#endif
+    return 0;
+}
+INIT_BOARD_EXPORT(embsim_init);
+
+void embsim_stat_get(embsim_stat_t *stat)
+{
+    memset(stat, 0, sizeof(embsim_stat_t));
+    pthread_mutex_lock(&embsim_aio_lock);
+    for (int i = 0; i < sizeof(embsim_flash) / sizeof(embsim_flash[0]); ++i)
+    {
+        const embsim_stat_t *s = &embsim_flash[i]->stat;
+        stat->rd_bytes     += s->rd_bytes;
+        stat->wr_bytes     += s->wr_bytes;
+        stat->er_bytes     += s->er_bytes;
+        stat->rd_count     += s->rd_count;
+        stat->wr_count     += s->wr_count;
+        stat->er_count     += s->er_count;
+        stat->wr_unaligned += s->wr_unaligned;
+        stat->wr_dirty     += s->wr_dirty;
+        stat->busy_ns      += s->busy_ns;
+    }
+    pthread_mutex_unlock(&embsim_aio_lock);
+}
+
+void embsim_stat_sub(embsim_stat_t *stat, const embsim_stat_t *base)
+{
+    stat->rd_bytes     -= base->rd_bytes;
+    stat->wr_bytes     -= base->wr_bytes;
+    stat->er_bytes     -= base->er_bytes;
+    stat->rd_count     -= base->rd_count;
+    stat->wr_count     -= base->wr_count;
+    stat->er_count     -= base->er_count;
+    stat->wr_unaligned -= base->wr_unaligned;
+    stat->wr_dirty     -= base->wr_dirty;
+    stat->busy_ns      -= base->busy_ns;
+}
+
+void embsim_jump(uint32_t msp, uintptr_t app)
+{
+    rt_kprintf("embsim: jump to app (msp = 0x%08X, pc = 0x%08X)\n", msp, (uint32_t)app);
+}
+
+static double embsim_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static int embsim_load_file(const char *part_name, const char *file)
+{
+    const struct fal_partition *part = fal_partition_find(part_name);
+    if (part == RT_NULL)
+    {
+        rt_kprintf("embsim: no partition %s!\n", part_name);
+        return -1;
+    }
+
+    FILE *fp = fopen(file, "rb");
+    if (fp == RT_NULL)
+    {
+        rt_kprintf("embsim: open %s failed!\n", file);
+        return -1;
+    }
+
+    static uint8_t buffer[4096];
+    uint32_t addr = 0;
+    size_t size;
+
+    fal_partition_erase_all(part);
+    emboot_ctrl_drop();                                     // in case it is [upctrl]
+    while ((size = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    {
+        if (addr + size > part->len || fal_partition_write(part, addr, buffer, size) < 0)
+        {
+            rt_kprintf("embsim: %s does not fit into %s!\n", file, part_name);
+            fclose(fp);
+            return -1;
+        }
+        addr += size;
+    }
+    fclose(fp);
+
+    return addr;
+}
+
+/**
+ * slices of the update phases (emboot_yield): the longest modelled time waited for the flash between two of them is
+ * the longest time the console and the watchdog have to wait.
+ */
+static uint64_t embsim_yield_last;                          // embsim_clock_us at the last slice
+static uint64_t embsim_yield_gap;                           // longest gap so far
+
+void embsim_yield(void)
+{
+    uint64_t now = embsim_clock_us();
+    if (now - embsim_yield_last > embsim_yield_gap)
+    {
+        embsim_yield_gap = now - embsim_yield_last;
+    }
+    embsim_yield_last = now;
+}
+
+#define EMBSIM_MAX_PHASE                16
+
+typedef struct embsim_phase_t
+{
+    const char                         *name;
+    double                              wall_ms;
+    uint64_t                            time_us;            // modelled time waited for the flash, see embsim_clock_us
+    embsim_stat_t                       stat;
+    uint32_t                            skipped;            // [curent/runapp] sectors left untouched
+    uint32_t                            rewritten;
+    uint32_t                            slices;             // see embsim_yield
+    uint64_t                            gap_us;
+} embsim_phase_t;
+
+static const char *embsim_step_name(int step)
+{
+    switch (step)
+    {
+    case emboot_step_verify: return "verify";
+    case emboot_step_decode: return "decode";
+    case emboot_step_backup: return "backup";
+    case emboot_step_docopy: return "docopy";
+    case emboot_step_revert: return "revert";
+    case emboot_step_recopy: return "recopy";
+    case emboot_step_rocopy: return "rocopy";
+    case emboot_step_finish: return "finish";
+    default:                 return "??????";
+    }
+}
+
+static void embsim_phase_print(const embsim_phase_t *phase)
+{
+    rt_kprintf("%-8s %10.1f %10.1f %10.1f %10llu %10llu %10llu %6u %6u %6u %6u %6u %6u %8.1f\n", phase->name,
+               phase->wall_ms, phase->stat.busy_ns / 1000000.0, phase->time_us / 1000.0,
+               (unsigned long long)phase->stat.rd_bytes,
+               (unsigned long long)phase->stat.wr_bytes,
+               (unsigned long long)phase->stat.er_bytes,
+               phase->stat.er_count,
+               phase->stat.wr_unaligned,
+               phase->stat.wr_dirty,
+               phase->skipped,
+               phase->rewritten,
+               phase->slices,
+               phase->gap_us / 1000.0);
+}
+
+/**
+ * embsim_bench [package]
+ *
+ * optionally loads a package into [dnload/backup] the way "download" does, then runs every update step
+ * until the state machine settles and reports the cost of each phase. flash: the time the devices were busy,
+ * time: the time waited for them (less with asynchronous i/o, which overlaps the devices). slices: the times an
+ * update phase served the console and the watchdog, gap: the longest time between two of them.
+ */
+void embsim_bench(char argc, char *argv)
+{
+    embsim_phase_t phase[EMBSIM_MAX_PHASE] = {{0}};
+    int nums = 0;
+    embsim_stat_t base;
+    double t0;
+    uint64_t c0;
+    emboot_read_stat_t rd0, rd1;
+
+    embget_read_stat(&rd0);
+
+    if (argc == 2)
+    {
+        embsim_stat_get(&base);
+        t0 = embsim_now_ms();
+        c0 = embsim_clock_us();
+        if (embsim_load_file("backup", &argv[(int)argv[1]]) < 0)
+        {
+            return;
+        }
+        phase[nums].name = "dnload";
+        phase[nums].wall_ms = embsim_now_ms() - t0;
+        phase[nums].time_us = embsim_clock_us() - c0;
+        embsim_stat_get(&phase[nums].stat);
+        embsim_stat_sub(&phase[nums].stat, &base);
+        nums++;
+
+        embsim_stat_get(&base);
+        t0 = embsim_now_ms();
+        c0 = embsim_clock_us();
+        int result = emboot_verify_precheck();
+        if (result == 0)
+        {
+            emboot_upctrl_reset();
+            embset_update_step(emboot_step_verify, 0);
+        }
+        phase[nums].name = "precheck";
+        phase[nums].wall_ms = embsim_now_ms() - t0;
+        phase[nums].time_us = embsim_clock_us() - c0;
+        embsim_stat_get(&phase[nums].stat);
+        embsim_stat_sub(&phase[nums].stat, &base);
+        nums++;
+        if (result != 0)
+        {
+            goto report;
+        }
+    }
+
+    while (nums < EMBSIM_MAX_PHASE)
+    {
+        int step = embget_update_step();
+        if (step == emboot_step_finish || step == -1)
+        {
+            break;
+        }
+
+        uint32_t skipped, rewritten;
+        uint32_t slices = embget_slice_stat();
+        embget_sync_stat(&skipped, &rewritten);
+        embsim_stat_get(&base);
+        t0 = embsim_now_ms();
+        c0 = embsim_clock_us();
+        embsim_yield_last = c0;
+        embsim_yield_gap = 0;
+        int stat = emboot_update();
+        phase[nums].name = embsim_step_name(step);
+        phase[nums].wall_ms = embsim_now_ms() - t0;
+        phase[nums].time_us = embsim_clock_us() - c0;
+        embsim_yield();                                     // the phase ends, emboot_core serves the console again
+        embsim_stat_get(&phase[nums].stat);
+        embsim_stat_sub(&phase[nums].stat, &base);
+        embget_sync_stat(&phase[nums].skipped, &phase[nums].rewritten);
+        phase[nums].skipped -= skipped;
+        phase[nums].rewritten -= rewritten;
+        phase[nums].slices = embget_slice_stat() - slices;
+        phase[nums].gap_us = embsim_yield_gap;
+        nums++;
+
+        if (stat != emboot_stat_busy)
+        {
+            break;
+        }
+    }
+
+report:
+    rt_kprintf("\n");
+    rt_kprintf("%-8s %10s %10s %10s %10s %10s %10s %6s %6s %6s %6s %6s %6s %8s\n", "phase", "wall(ms)", "flash(ms)", "time(ms)", "read(B)", "write(B)", "erase(B)", "erases", "unalgn", "dirty", "skip", "rewr", "slices", "gap(ms)");
+
+    embsim_phase_t total = {"total"};
+    for (int i = 0; i < nums; ++i)
+    {
+        embsim_phase_print(&phase[i]);
+        if (i > 0 || argc != 2)                             // the download itself is bound by the serial link
+        {
+            total.wall_ms        += phase[i].wall_ms;
+            total.stat.busy_ns   += phase[i].stat.busy_ns;
+            total.time_us        += phase[i].time_us;
+            total.stat.rd_bytes  += phase[i].stat.rd_bytes;
+            total.stat.wr_bytes  += phase[i].stat.wr_bytes;
+            total.stat.er_bytes  += phase[i].stat.er_bytes;
+            total.stat.er_count  += phase[i].stat.er_count;
+            total.stat.wr_unaligned += phase[i].stat.wr_unaligned;
+            total.stat.wr_dirty  += phase[i].stat.wr_dirty;
+            total.skipped        += phase[i].skipped;
+            total.rewritten      += phase[i].rewritten;
+            total.slices         += phase[i].slices;
+            total.gap_us          = phase[i].gap_us > total.gap_us ? phase[i].gap_us : total.gap_us;
+        }
+    }
+    embsim_phase_print(&total);
+
+    embget_read_stat(&rd1);
+    uint32_t old_lines = (rd1.old_hits - rd0.old_hits) + (rd1.old_misses - rd0.old_misses);
+    uint32_t patch_reads = (rd1.patch_hits - rd0.patch_hits) + (rd1.patch_fills - rd0.patch_fills);
+    if (old_lines || patch_reads || rd1.old_direct != rd0.old_direct || rd1.patch_direct != rd0.patch_direct)
+    {
+        rt_kprintf("\n");
+        rt_kprintf("old image cache    %8u hits %8u misses (%5.1f%%) %8u direct\n", rd1.old_hits - rd0.old_hits, rd1.old_misses - rd0.old_misses,
+                   old_lines ? (rd1.old_hits - rd0.old_hits) * 100.0 / old_lines : 0.0, rd1.old_direct - rd0.old_direct);
+        rt_kprintf("patch read-ahead   %8u hits %8u fills  (%5.1f%%) %8u direct\n", rd1.patch_hits - rd0.patch_hits, rd1.patch_fills - rd0.patch_fills,
+                   patch_reads ? (rd1.patch_hits - rd0.patch_hits) * 100.0 / patch_reads : 0.0, rd1.patch_direct - rd0.patch_direct);
+    }
+}
+
+/**
+ * embsim_load <partition> <file>
+ *
+ * erases the partition and programs the file to its start, e.g. to install the old firmware into [curent/runapp].
+ */
+void embsim_load(char argc, char *argv)
+{
+    if (argc == 3)
+    {
+        int size = embsim_load_file(&argv[(int)argv[1]], &argv[(int)argv[2]]);
+        if (size >= 0)
+        {
+            rt_kprintf("embsim: %d bytes loaded.\n", size);
+        }
+    }
+}
+
+/**
+ * runs the pending update steps, as the bootloader does after a reset.
+ */
+static void embsim_settle(void)
+{
+    for (int i = 0; i < EMBSIM_MAX_PHASE; ++i)
+    {
+        int step = embget_update_step();
+        if (step == emboot_step_finish || step == -1 || emboot_update() != emboot_stat_busy)
+        {
+            break;
+        }
+    }
+}
+
+static void embsim_mute(int mute)
+{
+    static int saved = -1;
+
+    fflush(stdout);
+    if (mute && saved < 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        saved = dup(STDOUT_FILENO);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    if (!mute && saved >= 0)
+    {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        saved = -1;
+    }
+}
+
+/**
+ * the image the next reset starts.
+ */
+static const uint8_t *embsim_boot_image(void)
+{
+#if defined(EMBOOT_AB_SLOT) && EMBOOT_AB_SLOT
+    if (embget_boot_slot())
+    {
+        return embsim_decode.mem;
+    }
+#endif
+    return embsim_runapp.mem;
+}
+
+/**
+ * fault injection runs: the expected boot image, and the flash state every run starts from.
+ */
+typedef struct embsim_inject_t
+{
+    uint8_t                             expect[EMBSIM_RUNAPP_SIZE];
+    size_t                              expect_len;
+    uint8_t                            *image[sizeof(embsim_flash) / sizeof(embsim_flash[0])];
+
+    struct
+    {
+        int                             step;
+        uint32_t                        hits;
+        uint64_t                        sum_us;
+        uint64_t                        max_us;
+    } cost[EMBSIM_MAX_PHASE];
+    int                                 steps;
+    int                                 failed;
+} embsim_inject_t;
+
+/**
+ * loads newapp, stages the package (if given) the way embsim_bench does, and takes the flash state.
+ */
+static embsim_inject_t *embsim_inject_init(char argc, char *argv)
+{
+    if (argc != 2 && argc != 3)
+    {
+        return RT_NULL;
+    }
+
+    FILE *fp = fopen(&argv[(int)argv[1]], "rb");
+    if (fp == RT_NULL)
+    {
+        rt_kprintf("embsim: open %s failed!\n", &argv[(int)argv[1]]);
+        return RT_NULL;
+    }
+    embsim_inject_t *inject = calloc(1, sizeof(embsim_inject_t));
+    inject->expect_len = fread(inject->expect, 1, sizeof(inject->expect), fp);
+    fclose(fp);
+
+    if (argc == 3)
+    {
+        if (embsim_load_file("backup", &argv[(int)argv[2]]) < 0 || emboot_verify_precheck() != 0)
+        {
+            free(inject);
+            return RT_NULL;
+        }
+        emboot_upctrl_reset();
+        embset_update_step(emboot_step_verify, 0);
+    }
+
+    for (int i = 0; i < sizeof(embsim_flash) / sizeof(embsim_flash[0]); ++i)
+    {
+        inject->image[i] = malloc(embsim_flash[i]->len);
+        memcpy(inject->image[i], embsim_flash[i]->mem, embsim_flash[i]->len);
+    }
+    return inject;
+}
+
+static void embsim_inject_reset(embsim_inject_t *inject)
+{
+    for (int i = 0; i < sizeof(embsim_flash) / sizeof(embsim_flash[0]); ++i)
+    {
+        memcpy(embsim_flash[i]->mem, inject->image[i], embsim_flash[i]->len);
+    }
+    emboot_ctrl_drop();
+}
+
+/**
+ * books the flash time of a recovery to the step the fault hit, and checks that newapp boots.
+ */
+static void embsim_inject_done(embsim_inject_t *inject, const char *what, uint32_t nth, int step, uint64_t busy_us)
+{
+    int i = 0;
+    while (i < inject->steps && inject->cost[i].step != step)
+    {
+        i++;
+    }
+    if (i == inject->steps && inject->steps < EMBSIM_MAX_PHASE)
+    {
+        inject->cost[inject->steps++].step = step;
+    }
+    if (i < inject->steps)
+    {
+        inject->cost[i].hits++;
+        inject->cost[i].sum_us += busy_us;
+        inject->cost[i].max_us = busy_us > inject->cost[i].max_us ? busy_us : inject->cost[i].max_us;
+    }
+
+    if (embget_update_step() != emboot_step_finish || memcmp(embsim_boot_image(), inject->expect, inject->expect_len) != 0)
+    {
+        if (inject->failed++ < 8)
+        {
+            rt_kprintf("embsim: %s %u (%s) not recovered!\n", what, nth, embsim_step_name(step));
+        }
+    }
+}
+
+static void embsim_inject_fini(embsim_inject_t *inject, const char *what, uint32_t nums, const char *cost)
+{
+    rt_kprintf("embsim: %u %s points, %d failed.\n", nums, what, inject->failed);
+    for (int i = 0; i < inject->steps; ++i)
+    {
+        rt_kprintf("embsim: %s in %-8s %5u times, %s: avg %8.1f ms, max %8.1f ms\n", what, embsim_step_name(inject->cost[i].step),
+                   inject->cost[i].hits, cost, inject->cost[i].sum_us / 1000.0 / inject->cost[i].hits, inject->cost[i].max_us / 1000.0);
+    }
+
+    for (int i = 0; i < sizeof(embsim_flash) / sizeof(embsim_flash[0]); ++i)
+    {
+        free(inject->image[i]);
+    }
+    free(inject);
+}
+
+/**
+ * embsim_cut <newapp> [package]
+ *
+ * power loss injection: runs the pending update (after staging the package the way embsim_bench does) once for
+ * every program/erase operation it performs, cutting the power half way through that operation. the update is then
+ * run again from the flash state left behind, as after a reset, and must end with newapp as the image that boots.
+ */
+void embsim_cut(char argc, char *argv)
+{
+    embsim_inject_t *inject = embsim_inject_init(argc, argv);
+    if (inject == RT_NULL)
+    {
+        return;
+    }
+
+    uint32_t cut;
+    for (cut = 1; ; ++cut)
+    {
+        embsim_inject_reset(inject);
+
+        embsim_mute(1);
+        embsim_cut_left = cut;
+        if (setjmp(embsim_cut_jmp) == 0)
+        {
+            embsim_settle();
+            embsim_cut_left = 0;
+            embsim_mute(0);
+            break;                                          // ran through, every operation has been cut once
+        }
+        const emboot_ctrl_t *ctrl = emboot_ctrl_map();
+        int step = ctrl ? ctrl->update_step : -1;
+        embsim_stat_t base, stat;
+        embsim_stat_get(&base);
+        emboot_ctrl_drop();                                 // the reset loses the ram shadow
+        embsim_settle();
+        embsim_mute(0);
+        embsim_stat_get(&stat);
+        embsim_stat_sub(&stat, &base);
+
+        embsim_inject_done(inject, "cut", cut, step, stat.busy_ns / 1000);
+    }
+
+    if (memcmp(embsim_boot_image(), inject->expect, inject->expect_len) != 0)
+    {
+        rt_kprintf("embsim: the uninterrupted update failed!\n");
+        inject->failed++;
+    }
+    embsim_inject_fini(inject, "cut", cut - 1, "flash time until done");
+}
+
+/**
+ * embsim_weak <newapp> [package]
+ *
+ * program failure injection: runs the pending update once for every program operation it performs on an image
+ * partition, with one bit of that operation failing to program. the update must still end with newapp as the image
+ * that boots, the flash time it takes over the clean run is the cost of the retry.
+ */
+void embsim_weak(char argc, char *argv)
+{
+    embsim_inject_t *inject = embsim_inject_init(argc, argv);
+    if (inject == RT_NULL)
+    {
+        return;
+    }
+
+    embsim_stat_t base, stat;
+    embsim_stat_get(&base);
+    embsim_mute(1);
+    embsim_settle();
+    embsim_mute(0);
+    embsim_stat_get(&stat);
+    embsim_stat_sub(&stat, &base);
+    uint64_t clean_ns = stat.busy_ns;
+
+    uint32_t weak;
+    for (weak = 1; ; ++weak)
+    {
+        embsim_inject_reset(inject);
+
+        embsim_stat_get(&base);
+        embsim_mute(1);
+        embsim_weak_left = weak;
+        embsim_settle();
+        embsim_mute(0);
+        embsim_stat_get(&stat);
+        embsim_stat_sub(&stat, &base);
+        if (embsim_weak_left)
+        {
+            embsim_weak_left = 0;
+            break;                                          // ran through, every operation has been weak once
+        }
+
+        embsim_inject_done(inject, "weak", weak, embsim_weak_step, stat.busy_ns > clean_ns ? (stat.busy_ns - clean_ns) / 1000 : 0);
+    }
+    embsim_inject_fini(inject, "weak", weak - 1, "extra flash time");
+}
+
+/**
+ * embsim_boot
+ *
+ * runs the reset time boot decision. the jump prints the vector of the image it would start, nothing is printed
+ * when it stays in the bootloader.
+ */
+void embsim_boot(char argc, char *argv)
+{
+    emboot_fast_boot();
+}
+
+/**
+ * embsim_stay
+ *
+ * an application asks the bootloader to stay, the way it did before the journal: only update_stay is programmed at
+ * [upctrl:0]. checks that the request keeps the rest of the control block (the active slot in A/B slot mode), when
+ * the fast boot maps it and once it is imported, and that the import erases it.
+ */
+void embsim_stay(char argc, char *argv)
+{
+    emboot_ctrl_t before;
+    emboot_ctrl_t expect;
+    emboot_ctrl_t req;
+    const emboot_ctrl_t *ctrl = emboot_ctrl_map();
+    if (ctrl)
+    {
+        before = *ctrl;
+    }
+    else
+    {
+        memset(&before, 0xFF, sizeof(emboot_ctrl_t));
+    }
+    expect = before;
+    expect.update_stay = 1;
+    memset(&req, 0xFF, sizeof(emboot_ctrl_t));
+    req.update_stay = 1;
+    embsim_write(&embsim_update, 0, (const uint8_t *)&req, sizeof(req));
+
+    int failed = memcmp(emboot_ctrl_map(), &expect, sizeof(expect)) != 0;
+
+    emboot_ctrl_drop();                                     // the reset that imports it
+    failed |= embget_update_step() != (int)expect.update_step;
+    failed |= memcmp(emboot_ctrl_map(), &expect, sizeof(expect)) != 0;
+    for (size_t i = 0; i < sizeof(emboot_ctrl_t); ++i)
+    {
+        failed |= embsim_update.mem[i] != 0xFF;
+    }
+#if defined(EMBOOT_AB_SLOT) && EMBOOT_AB_SLOT
+    rt_kprintf("embsim: boot slot %d.\n", embget_boot_slot());
+#endif
+    failed |= embget_update_stay() != 1;                    // taken once, as the full boot does
+    rt_kprintf("embsim: stay request %s.\n", failed ? "failed" : "ok");
+}
+
+/**
+ * the bytewise crc with a lazily built ram table, as emboot used before the slice-by-n kernel.
+ */
+static uint32_t embsim_crc_ref(const uint8_t *data, size_t len, uint32_t crc)
+{
+    static uint32_t table[256];
+    static int mark;
+
+    if (!mark)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i << 24;
+            for (int k = 0; k < 8; k++)
+            {
+                c = (c & 0x80000000) ? (c << 1) ^ 0x04C11DB7 : (c << 1);
+            }
+            table[i] = c;
+        }
+        mark = 1;
+    }
+
+    while (len--)
+    {
+        crc = (crc << 8) ^ table[((crc >> 24) ^ *data) & 0xFF];
+        data++;
+    }
+    return crc;
+}
+
+/**
+ * embsim_crc [kbytes]
+ *
+ * cross-checks embcrc against the bytewise reference on random data, lengths and alignments, then reports MB/s of both.
+ */
+void embsim_crc(char argc, char *argv)
+{
+    size_t size = (argc == 2 ? atoi(&argv[(int)argv[1]]) : 1024) * 1024;
+    uint8_t *data = malloc(size + 8);
+    if (data == RT_NULL) return;
+
+    srand(1);
+    for (size_t i = 0; i < size + 8; ++i)
+    {
+        data[i] = rand();
+    }
+
+    int error = 0;
+    for (int i = 0; i < 10000 && !error; ++i)
+    {
+        size_t bgn = rand() % 8;
+        size_t len = rand() % (i < 5000 ? 64 : 4096);
+        uint32_t seed = rand();
+        error = embcrc(data + bgn, len, seed) != embsim_crc_ref(data + bgn, len, seed);
+    }
+    rt_kprintf("embsim: crc cross-check %s\n", error ? "failed!" : "ok!");
+
+    // combine random splits, and erased runs against hashing 0xFF bytes.
+    for (int i = 0; i < 1000 && !error; ++i)
+    {
+        size_t len = rand() % (size < 65536 ? size : 65536);
+        size_t cut = len ? rand() % len : 0;
+        uint32_t seed = rand();
+        error |= embcrc_combine(embcrc(data, cut, 0xFFFFFFFF), embcrc(data + cut, len - cut, 0xFFFFFFFF), len - cut) != embcrc(data, len, 0xFFFFFFFF);
+
+        memset(data + size - len, 0xFF, len);
+        error |= embcrc_ones(seed, len) != embcrc(data + size - len, len, seed);
+        for (size_t j = size - len; j < size; ++j)
+        {
+            data[j] = rand();
+        }
+    }
+    rt_kprintf("embsim: crc algebra check %s\n", error ? "failed!" : "ok!");
+
+    double t0 = embsim_now_ms();
+    uint32_t ref = embsim_crc_ref(data, size, 0xFFFFFFFF);
+    double t1 = embsim_now_ms();
+    uint32_t crc = embcrc(data, size, 0xFFFFFFFF);
+    double t2 = embsim_now_ms();
+
+    rt_kprintf("embsim: bytewise    0x%08X %8.1f MB/s\n", ref, size / 1048576.0 / ((t1 - t0) / 1000.0));
+    rt_kprintf("embsim: embcrc      0x%08X %8.1f MB/s\n", crc, size / 1048576.0 / ((t2 - t1) / 1000.0));
+
+    free(data);
+}
+
+/**
+ * mock of an on-chip crc unit computing CRC-32/MPEG-2, fed word or byte wise through its data register.
+ * it is computed bit by bit on purpose, independent of embcrc.
+ */
+static uint32_t embsim_crcu_dr;
+static uint64_t embsim_crcu_feed;
+
+static void embsim_crcu_reset(void)
+{
+    embsim_crcu_dr = 0xFFFFFFFF;
+}
+
+static void embsim_crcu_write(uint32_t data, int bits)
+{
+    embsim_crcu_dr ^= data << (32 - bits);
+    for (int i = 0; i < bits; ++i)
+    {
+        embsim_crcu_dr = (embsim_crcu_dr & 0x80000000) ? (embsim_crcu_dr << 1) ^ 0x04C11DB7 : (embsim_crcu_dr << 1);
+    }
+    embsim_crcu_feed += bits / 8;
+}
+
+static void embsim_hash_crcu_init(void)
+{
+    embsim_crcu_reset();
+}
+
+static void embsim_hash_crcu_update(const uint8_t *data, size_t size)
+{
+    for (; size >= 4; data += 4, size -= 4)
+    {
+        embsim_crcu_write(((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3], 32);
+    }
+    for (; size > 0; data += 1, size -= 1)
+    {
+        embsim_crcu_write(data[0], 8);
+    }
+}
+
+static uint32_t embsim_hash_crcu_final(void)
+{
+    return embsim_crcu_dr;
+}
+
+const emboot_hash_t embsim_hash_crcu =
+{
+    embsim_hash_crcu_init,
+    embsim_hash_crcu_update,
+    embsim_hash_crcu_final,
+};
+
+/**
+ * embsim_hash [soft|crcu]
+ *
+ * without argument, cross-checks the software engine against the crc unit mock on randomly split random data.
+ * with an argument, selects the engine used by emboot_calc_hash (run embsim_bench afterwards).
+ */
+void embsim_hash(char argc, char *argv)
+{
+    if (argc == 2)
+    {
+        const char *name = &argv[(int)argv[1]];
+        emboot_hash_set(!strcmp(name, "crcu") ? &embsim_hash_crcu : &emboot_hash_soft);
+        rt_kprintf("embsim: hash engine = %s\n", !strcmp(name, "crcu") ? "crcu" : "soft");
+        return;
+    }
+
+    static uint8_t data[8192];
+    srand(2);
+    for (size_t i = 0; i < sizeof(data); ++i)
+    {
+        data[i] = rand();
+    }
+
+    const emboot_hash_t *engine[2] = {&emboot_hash_soft, &embsim_hash_crcu};
+    uint32_t result[2];
+    int error = 0;
+
+    for (int n = 0; n < 2000 && !error; ++n)
+    {
+        size_t size = rand() % sizeof(data);
+        unsigned seed = rand();
+        for (int e = 0; e < 2; ++e)
+        {
+            srand(seed + e);                                // split the data differently for each engine
+            engine[e]->init();
+            for (size_t pos = 0, len; pos < size; pos += len)
+            {
+                len = 1 + rand() % 1500;
+                len = len > size - pos ? size - pos : len;
+                engine[e]->update(data + pos, len);
+                if (rand() % 4 == 0)
+                {
+                    engine[e]->final();
+                }
+            }
+            result[e] = engine[e]->final();
+        }
+        error = result[0] != result[1];
+    }
+    rt_kprintf("embsim: hash engine cross-check %s (%llu bytes through crcu)\n", error ? "failed!" : "ok!", (unsigned long long)embsim_crcu_feed);
+}
+
+/**
+ * pty backed serial device: emboot receives on the slave side through the rt-thread device api, the sender
+ * below drives the master side at a given baud rate.
+ */
+static struct rt_device embsim_pty_dev;
+static int embsim_pty_master = -1;
+static int embsim_pty_slave = -1;
+static volatile int embsim_pty_quit;
+
+static rt_ssize_t embsim_pty_read(rt_device_t dev, rt_off_t pos, void *buffer, rt_size_t size)
+{
+    ssize_t n = read(embsim_pty_slave, buffer, size);
+    return n > 0 ? n : 0;
+}
+
+static rt_ssize_t embsim_pty_write(rt_device_t dev, rt_off_t pos, const void *buffer, rt_size_t size)
+{
+    ssize_t n = write(embsim_pty_slave, buffer, size);
+    return n > 0 ? n : 0;
+}
+
+static void embsim_pty_poll(void *parameter)
+{
+    struct pollfd pfd = {embsim_pty_slave, POLLIN, 0};
+
+    while (!embsim_pty_quit)
+    {
+        if (poll(&pfd, 1, 10) > 0 && (pfd.revents & POLLIN) && embsim_pty_dev.rx_indicate)
+        {
+            embsim_pty_dev.rx_indicate(&embsim_pty_dev, 1);
+            usleep(100);
+        }
+    }
+}
+
+static int embsim_pty_open(void)
+{
+    struct termios tio;
+
+    embsim_pty_master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (embsim_pty_master < 0 || grantpt(embsim_pty_master) < 0 || unlockpt(embsim_pty_master) < 0)
+    {
+        return -1;
+    }
+    embsim_pty_slave = open(ptsname(embsim_pty_master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (embsim_pty_slave < 0)
+    {
+        close(embsim_pty_master);
+        return -1;
+    }
+    tcgetattr(embsim_pty_slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(embsim_pty_slave, TCSANOW, &tio);
+
+    if (embsim_pty_dev.read == RT_NULL)
+    {
+        embsim_pty_dev.type  = RT_Device_Class_Char;
+        embsim_pty_dev.read  = embsim_pty_read;
+        embsim_pty_dev.write = embsim_pty_write;
+        rt_device_register(&embsim_pty_dev, "embpty", RT_DEVICE_FLAG_RDWR);
+    }
+
+    embsim_pty_quit = 0;
+    rt_thread_t thread = rt_thread_create("embpty", embsim_pty_poll, RT_NULL, 1024, RT_THREAD_PRIORITY_MAX - 2, 10);
+    if (thread == RT_NULL)
+    {
+        return -1;
+    }
+    rt_thread_startup(thread);
+    return 0;
+}
+
+static void embsim_pty_close(void)
+{
+    embsim_pty_quit = 1;
+    usleep(50000);
+    close(embsim_pty_slave);
+    close(embsim_pty_master);
+    embsim_pty_slave = -1;
+    embsim_pty_master = -1;
+}
+
+/**
+ * ymodem-1k sender on the master side, paced to the line rate of an 8n1 uart.
+ */
+typedef struct embsim_sender_t
+{
+    const char                         *file;
+    uint32_t                            baud;
+    long                                size;               // payload
+    long                                from;               // resume offset announced by the receiver
+    long                                cut;                // drop the link after this many payload bytes, -1: never
+    double                              t0;
+    double                              line;               // time the line is free again
+    uint64_t                            bytes;              // bytes put on the line
+    uint32_t                            resent;
+    uint32_t                            loss;               // frames per thousand corrupted on the line
+    int                                 result;
+} embsim_sender_t;
+
+static uint16_t embsim_crc16(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0;
+    while (len--)
+    {
+        crc ^= *data++ << 8;
+        for (int i = 0; i < 8; ++i)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+static void embsim_sender_put(embsim_sender_t *tx, const uint8_t *data, size_t size)
+{
+    while (size)
+    {
+        size_t n = size < 64 ? size : 64;
+        if (write(embsim_pty_master, data, n) != (ssize_t)n)
+        {
+            return;
+        }
+        data += n;
+        size -= n;
+        tx->bytes += n;
+
+        double now = embsim_now_ms();
+        tx->line = (tx->line > now ? tx->line : now) + n * 10 * 1000.0 / tx->baud;
+        if (tx->line > now)
+        {
+            usleep((useconds_t)((tx->line - now) * 1000));
+        }
+    }
+}
+
+static int embsim_sender_get(int timeout_ms)
+{
+    struct pollfd pfd = {embsim_pty_master, POLLIN, 0};
+    uint8_t ch;
+
+    if (poll(&pfd, 1, timeout_ms) <= 0 || read(embsim_pty_master, &ch, 1) != 1)
+    {
+        return -1;
+    }
+    return ch;
+}
+
+static int embsim_sender_wait(int expect, int timeout_ms)
+{
+    double end = embsim_now_ms() + timeout_ms;
+    while (embsim_now_ms() < end)
+    {
+        int ch = embsim_sender_get(10);
+        if (ch == expect || ch == 0x18)
+        {
+            return ch;
+        }
+    }
+    return -1;
+}
+
+/**
+ * waits for the first 'C' and picks up a "resume at <offset>" line sent ahead of it.
+ */
+static int embsim_sender_hello(embsim_sender_t *tx, int timeout_ms)
+{
+    char line[32];
+    int size = 0;
+    double end = embsim_now_ms() + timeout_ms;
+
+    while (embsim_now_ms() < end)
+    {
+        int ch = embsim_sender_get(10);
+        if (ch == 'C')
+        {
+            return 0;
+        }
+        if (ch == '\n')
+        {
+            line[size] = '\0';
+            sscanf(line, "resume at %ld", &tx->from);
+            size = 0;
+        }
+        else
+        if (ch >= 0 && size < (int)sizeof(line) - 1)
+        {
+            line[size++] = ch;
+        }
+    }
+    return -1;
+}
+
+static int embsim_sender_block(embsim_sender_t *tx, uint8_t seq, const uint8_t *data, size_t size)
+{
+    uint8_t head[3] = {size == 1024 ? 0x02 : 0x01, seq, (uint8_t)~seq};
+    uint16_t crc = embsim_crc16(data, size);
+    uint8_t tail[2] = {crc >> 8, crc & 0xFF};
+
+    for (int i = 0; i < 10; ++i)
+    {
+        embsim_sender_put(tx, head, 3);
+        embsim_sender_put(tx, data, size);
+        embsim_sender_put(tx, tail, 2);
+
+        int ch;
+        do
+        {
+            ch = embsim_sender_get(10000);
+        } while (ch == 'C');                                // left over handshake characters
+
+        if (ch == 0x06) return 0;
+        if (ch != 0x15) return -1;
+        tx->resent++;
+    }
+    return -1;
+}
+
+static void *embsim_sender_entry(void *parameter)
+{
+    embsim_sender_t *tx = parameter;
+    static uint8_t data[1024];
+    size_t size;
+    uint8_t seq = 1;
+
+    tx->result = -1;
+
+    FILE *fp = fopen(tx->file, "rb");
+    if (fp == RT_NULL)
+    {
+        return RT_NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    tx->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (embsim_sender_hello(tx, 10000) < 0 || tx->from > tx->size)
+    {
+        goto exit;
+    }
+    tx->t0 = embsim_now_ms();
+    fseek(fp, tx->from, SEEK_SET);
+
+    memset(data, 0, 128);
+    const char *name = strrchr(tx->file, '/') ? strrchr(tx->file, '/') + 1 : tx->file;
+    snprintf((char *)data + snprintf((char *)data, 64, "%s", name) + 1, 32, "%ld", tx->size - tx->from);
+    if (embsim_sender_block(tx, 0, data, 128) < 0 || embsim_sender_wait('C', 10000) != 'C')
+    {
+        goto exit;
+    }
+
+    for (long sent = 0; (size = fread(data, 1, 1024, fp)) > 0; sent += size)
+    {
+        if (tx->cut >= 0 && sent >= tx->cut)
+        {
+            goto exit;                                      // the receiver has to time out
+        }
+        size_t blen = size <= 128 ? 128 : 1024;
+        memset(data + size, 0x1A, blen - size);
+        if (embsim_sender_block(tx, seq++, data, blen) < 0)
+        {
+            goto exit;
+        }
+    }
+
+    uint8_t eot = 0x04;
+    for (int i = 0; i < 10; ++i)
+    {
+        embsim_sender_put(tx, &eot, 1);
+        if (embsim_sender_get(3000) == 0x06)
+        {
+            break;
+        }
+    }
+    if (embsim_sender_wait('C', 3000) == 'C')
+    {
+        memset(data, 0, 128);
+        embsim_sender_block(tx, 0, data, 128);
+    }
+    tx->result = 0;
+
+exit:
+    fclose(fp);
+    return RT_NULL;
+}
+
+/**
+ * embsim_rym [-c] <package> [baud] [cut]
+ *
+ * sends the package over a pty at the given baud rate (default 115200) and receives it with "download",
+ * with the flash latency played in real time. reports the payload throughput against the line rate.
+ * -c receives with "download -c", cut drops the link after that many payload bytes.
+ */
+void embsim_rym(char argc, char *argv)
+{
+    embsim_sender_t tx = {0};
+    embsim_stat_t base, stat;
+    pthread_t thread;
+    int resume = 0;
+    int i = 1;
+
+    if (argc >= 2 && !strcmp("-c", &argv[(int)argv[1]]))
+    {
+        resume = 1;
+        i++;
+    }
+    if (argc < i + 1)
+    {
+        return;
+    }
+    tx.file = &argv[(int)argv[i]];
+    tx.baud = argc >= i + 2 ? atoi(&argv[(int)argv[i + 1]]) : 115200;
+    tx.cut  = argc >= i + 3 ? atol(&argv[(int)argv[i + 2]]) : -1;
+
+    if (embsim_pty_open() < 0)
+    {
+        rt_kprintf("embsim: open pty failed!\n");
+        return;
+    }
+
+    int realtime = embsim_realtime;
+    embsim_realtime = 1;
+    embsim_stat_get(&base);
+
+    pthread_create(&thread, RT_NULL, embsim_sender_entry, &tx);
+    int result = embrym_recv_on(&embsim_pty_dev, resume);
+    pthread_join(thread, RT_NULL);
+    double wall = embsim_now_ms() - tx.t0;
+
+    embsim_stat_get(&stat);
+    embsim_stat_sub(&stat, &base);
+    embsim_realtime = realtime;
+    embsim_pty_close();
+
+    if (result < 0 || tx.result < 0)
+    {
+        rt_kprintf("embsim: transfer failed!\n");
+        return;
+    }
+
+    double line = tx.baud / 10.0;
+    double rate = (tx.size - tx.from) / (wall / 1000.0);
+    rt_kprintf("embsim: %ld bytes from %ld in %.1f ms, %.1f KB/s, line %.1f KB/s (%.1f%% busy with payload), %u resent, flash busy %.1f ms\n",
+               tx.size - tx.from, tx.from, wall, rate / 1024, line / 1024,
+               rate * 100 / line, tx.resent, stat.busy_ns / 1000000.0);
+}
+
+/**
+ * sender of the windowed download ("download -w"), see embwin_recv_on for the frame format.
+ */
+#define EMBSIM_WIN_MAX                  32
+#define EMBSIM_WIN_FRAME_MAX            (64 * 1024)
+
+static uint8_t embsim_win_frame[10 + EMBSIM_WIN_FRAME_MAX + 4];
+
+static void embsim_win_send(embsim_sender_t *tx, uint8_t type, uint32_t index, const uint8_t *data, uint16_t len)
+{
+    uint8_t *frame = embsim_win_frame;
+
+    frame[0] = 0xA5;
+    frame[1] = 0x5A;
+    frame[2] = type;
+    frame[3] = 0x00;
+    memcpy(&frame[4], &len, 2);
+    memcpy(&frame[6], &index, 4);
+    memmove(&frame[10], data, len);
+    uint32_t crc = embcrc(&frame[2], 8 + len, 0xFFFFFFFF);
+    memcpy(&frame[10 + len], &crc, 4);
+
+    if (tx->loss && (uint32_t)(rand() % 1000) < tx->loss)
+    {
+        frame[10 + len] ^= 0x01;                            // corrupted on the line
+    }
+    embsim_sender_put(tx, frame, 10 + len + 4);
+}
+
+/**
+ * return: frame type, 0 if corrupted, -1 on timeout. the payload is left in buf.
+ */
+static int embsim_win_recv(uint32_t *index, uint8_t *buf, int timeout_ms)
+{
+    uint8_t head[10];
+    uint16_t len;
+    uint32_t crc;
+    int last = 0, ch = 0;
+
+    do
+    {
+        last = ch;
+        if ((ch = embsim_sender_get(timeout_ms)) < 0) return -1;
+    } while (last != 0xA5 || ch != 0x5A);
+
+    head[0] = 0xA5;
+    head[1] = 0x5A;
+    for (int i = 2; i < 10; ++i)
+    {
+        if ((ch = embsim_sender_get(timeout_ms)) < 0) return -1;
+        head[i] = ch;
+    }
+    memcpy(&len, &head[4], 2);
+    memcpy(index, &head[6], 4);
+    if (len > 16) return 0;
+
+    uint8_t tail[16 + 4];
+    for (int i = 0; i < len + 4; ++i)
+    {
+        if ((ch = embsim_sender_get(timeout_ms)) < 0) return -1;
+        tail[i] = ch;
+    }
+    memcpy(&crc, &tail[len], 4);
+    if (crc != embcrc(tail, len, embcrc(&head[2], 8, 0xFFFFFFFF))) return 0;
+
+    memcpy(buf, tail, len);
+    return head[2];
+}
+
+static void *embsim_win_entry(void *parameter)
+{
+    embsim_sender_t *tx = parameter;
+    uint8_t *data = RT_NULL;
+    uint8_t reply[16];
+    uint32_t index;
+    uint32_t nums = 0, frame = 0;
+    int type;
+
+    tx->result = -1;
+
+    FILE *fp = fopen(tx->file, "rb");
+    if (fp == RT_NULL)
+    {
+        return RT_NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    tx->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    double end = embsim_now_ms() + 10000;
+    while ((type = embsim_win_recv(&index, reply, 100)) != 'R' && embsim_now_ms() < end);
+    if (type != 'R')
+    {
+        goto exit;
+    }
+    memcpy(&nums, &reply[0], 4);
+    memcpy(&frame, &reply[4], 4);
+    if (nums == 0 || nums > EMBSIM_WIN_MAX || frame == 0 || frame > EMBSIM_WIN_FRAME_MAX)
+    {
+        goto exit;
+    }
+    tx->t0 = embsim_now_ms();
+
+    data = malloc(tx->size + frame);
+    if (data == RT_NULL || fread(data, 1, tx->size, fp) != (size_t)tx->size)
+    {
+        goto exit;
+    }
+
+    uint32_t size = tx->size;
+    uint32_t total = (size + frame - 1) / frame;
+    uint32_t base = (uint32_t)-1;
+    uint32_t bitmap = 0;
+    double   sent[EMBSIM_WIN_MAX] = {0};                    // per window slot (index % nums), 0: to be sent
+    uint32_t dups = 0;
+    double   rto = 200 + 3 * (nums * (frame + 14) * 10 * 1000.0 / tx->baud);
+
+    // hello, until the first status.
+    for (int i = 0; i < 10 && base == (uint32_t)-1; ++i)
+    {
+        embsim_win_send(tx, 'H', 0, (uint8_t *)&size, 4);
+        double due = embsim_now_ms() + rto;
+        while (embsim_now_ms() < due)
+        {
+            type = embsim_win_recv(&index, reply, 10);
+            if (type == 'S')
+            {
+                base = index;
+                memcpy(&bitmap, reply, 4);
+                break;
+            }
+        }
+    }
+    if (base == (uint32_t)-1)
+    {
+        goto exit;
+    }
+
+    uint32_t next = base;                                   // first frame never sent
+    while (base < total)
+    {
+        // a frame in the window that is due: never sent, or not acknowledged within rto.
+        double now = embsim_now_ms();
+        uint32_t pick = (uint32_t)-1;
+        for (uint32_t i = base; i < base + nums && i < total; ++i)
+        {
+            int acked = i > base && (bitmap & (1u << (i - base - 1)));
+            if (!acked && (i >= next || now - sent[i % nums] > rto))
+            {
+                pick = i;
+                break;
+            }
+        }
+
+        if (pick != (uint32_t)-1)
+        {
+            if (pick < next)
+            {
+                tx->resent++;
+            }
+            uint32_t len = pick == total - 1 ? size - pick * frame : frame;
+            embsim_win_send(tx, 'D', pick, data + pick * frame, len);
+            sent[pick % nums] = embsim_now_ms();
+            if (pick >= next)
+            {
+                next = pick + 1;
+            }
+        }
+
+        // drain the status frames, waiting for one only when nothing can be sent.
+        while ((type = embsim_win_recv(&index, reply, pick == (uint32_t)-1 ? 10 : 0)) >= 0)
+        {
+            if (type == 'C')
+            {
+                goto exit;
+            }
+            if (type != 'S')
+            {
+                continue;
+            }
+
+            uint32_t mask;
+            memcpy(&mask, reply, 4);
+            if (index == base && mask != 0 && index < next)
+            {
+                // frames behind the first missing one arrived: resend it once it was reported twice.
+                if (++dups == 2)
+                {
+                    sent[base % nums] = 0;
+                }
+            }
+            else
+            if (index != base)
+            {
+                dups = 0;
+            }
+            if (index >= base)
+            {
+                base = index;
+                bitmap = mask;
+            }
+            pick = 0;
+        }
+    }
+
+    for (int i = 0; i < 10; ++i)
+    {
+        embsim_win_send(tx, 'E', 0, RT_NULL, 0);
+        if (embsim_win_recv(&index, reply, 1000) == 'S' && index >= total)
+        {
+            tx->result = 0;
+            break;
+        }
+    }
+
+exit:
+    free(data);
+    fclose(fp);
+    return RT_NULL;
+}
+
+/**
+ * embsim_win <package> [baud] [loss]
+ *
+ * as embsim_rym, but with the windowed transport ("download -w"). loss corrupts that many frames per thousand.
+ */
+void embsim_win(char argc, char *argv)
+{
+    embsim_sender_t tx = {0};
+    embsim_stat_t base, stat;
+    pthread_t thread;
+
+    if (argc < 2)
+    {
+        return;
+    }
+    tx.file = &argv[(int)argv[1]];
+    tx.baud = argc >= 3 ? atoi(&argv[(int)argv[2]]) : 115200;
+    tx.loss = argc >= 4 ? atoi(&argv[(int)argv[3]]) : 0;
+    srand(1);
+
+    if (embsim_pty_open() < 0)
+    {
+        rt_kprintf("embsim: open pty failed!\n");
+        return;
+    }
+
+    int realtime = embsim_realtime;
+    embsim_realtime = 1;
+    embsim_stat_get(&base);
+
+    pthread_create(&thread, RT_NULL, embsim_win_entry, &tx);
+    int result = embwin_recv_on(&embsim_pty_dev);
+    pthread_join(thread, RT_NULL);
+    double wall = embsim_now_ms() - tx.t0;
+
+    embsim_stat_get(&stat);
+    embsim_stat_sub(&stat, &base);
+    embsim_realtime = realtime;
+    embsim_pty_close();
+
+    if (result < 0 || tx.result < 0)
+    {
+        rt_kprintf("embsim: transfer failed!\n");
+        return;
+    }
+
+    double line = tx.baud / 10.0;
+    double rate = tx.size / (wall / 1000.0);
+    rt_kprintf("embsim: %ld bytes in %.1f ms, %.1f KB/s, line %.1f KB/s (%.1f%% busy with payload), %u resent, flash busy %.1f ms\n",
+               tx.size, wall, rate / 1024, line / 1024,
+               rate * 100 / line, tx.resent, stat.busy_ns / 1000000.0);
+}
+
+NR_SHELL_CMD_EXPORT(embsim_bench, embsim_bench);
+NR_SHELL_CMD_EXPORT(embsim_hash, embsim_hash);
+NR_SHELL_CMD_EXPORT(embsim_crc, embsim_crc);
+NR_SHELL_CMD_EXPORT(embsim_load, embsim_load);
+NR_SHELL_CMD_EXPORT(embsim_boot, embsim_boot);
+NR_SHELL_CMD_EXPORT(embsim_stay, embsim_stay);
+NR_SHELL_CMD_EXPORT(embsim_cut, embsim_cut);
+NR_SHELL_CMD_EXPORT(embsim_weak, embsim_weak);
+NR_SHELL_CMD_EXPORT(embsim_rym, embsim_rym);
+NR_SHELL_CMD_EXPORT(embsim_win, embsim_win);
@@ -0,0 +1,155 @@
+/**
+ * Copyright (c) 2024, liujitong, <sulfurandcu@gmail.com>
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __emboot_sim_h__
+#define __emboot_sim_h__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * host simulator for the rt-thread simulator bsp (linux).
+ *
+ * include this file from the rtconfig.h of the simulator bsp and use the tables below in its fal_cfg.h:
+ *
+ *     #define FAL_FLASH_DEV_TABLE  { EMBSIM_FLASH_DEV_TABLE }
+ *     #define FAL_PART_TABLE       EMBSIM_PART_TABLE
+ *
+ * every partition lives on its own simulated nor flash device, backed by the file "<EMBSIM_FLASH_DIR>/<name>.bin".
+ * the partitions can be compiled into emboot as well (no fal lookups):
+ *
+ *     #define EMBOOT_PART_TABLE    EMBSIM_PART_TABLE
+ *     #define EMBOOT_PART_DEVS     EMBSIM_PART_DEVS
+ */
+
+#ifndef EMBSIM_FLASH_DIR
+#define EMBSIM_FLASH_DIR                "."
+#endif
+
+#ifndef EMBSIM_REALTIME
+#define EMBSIM_REALTIME                 0                   // 1: sleep for the modelled flash latency, 0: only account for it.
+#endif
+
+#ifndef EMBSIM_BLANK_CHECK
+#define EMBSIM_BLANK_CHECK              1                   // model a hardware blank check (emboot_blank_set), 0: none.
+#endif
+
+#ifndef EMBSIM_MMAP
+#define EMBSIM_MMAP                     1                   // map the internal flash models ([upctrl], [runapp]) for emboot_mmap_set, 0: none.
+#endif
+
+#ifndef EMBSIM_AIO
+#define EMBSIM_AIO                      1                   // serve the asynchronous i/o (emboot_aio_set) from a worker thread per flash model, 0: none.
+#endif
+
+#ifndef EMBSIM_UPDATE_SIZE
+#define EMBSIM_UPDATE_SIZE              (16 * 1024)
+#endif
+#ifndef EMBSIM_RUNAPP_SIZE
+#define EMBSIM_RUNAPP_SIZE              (512 * 1024)
+#endif
+#ifndef EMBSIM_BACKUP_SIZE
+#define EMBSIM_BACKUP_SIZE              (512 * 1024)
+#endif
+#ifndef EMBSIM_DECODE_SIZE
+#define EMBSIM_DECODE_SIZE              (512 * 1024)
+#endif
+#ifndef EMBSIM_SCRATCH_SIZE
+#define EMBSIM_SCRATCH_SIZE             (4 * 1024)          // swap mode (EMBOOT_SWAP_MODE) only
+#endif
+
+typedef struct embsim_stat_t
+{
+    uint64_t                            rd_bytes;
+    uint64_t                            wr_bytes;
+    uint64_t                            er_bytes;
+
+    uint32_t                            rd_count;           // read operations
+    uint32_t                            wr_count;           // program operations
+    uint32_t                            er_count;           // erased blocks
+
+    uint32_t                            wr_unaligned;       // program operations violating the write granularity
+    uint32_t                            wr_dirty;           // program operations trying to flip 0 bits back to 1
+
+    uint64_t                            busy_ns;            // modelled flash busy time
+
+} embsim_stat_t;
+
+typedef struct embsim_flash_t
+{
+    const char                         *name;               // device name, also the name of the backing file
+
+    size_t                              len;
+    size_t                              blk_size;           // erase granularity (bytes)
+    size_t                              page_size;          // program page (bytes)
+    size_t                              write_gran;         // write granularity (bits), same meaning as fal
+
+    uint32_t                            read_op_ns;         // command/address overhead of a read operation
+    uint32_t                            read_ns;            // per byte
+    uint32_t                            prog_us;            // per page
+    uint32_t                            erase_us;           // per block
+
+    uint8_t                            *mem;
+    embsim_stat_t                       stat;
+    uint64_t                            free_ns;            // modelled time the device is done with the operations started on it
+
+} embsim_flash_t;
+
+struct fal_flash_dev;
+
+extern embsim_flash_t                   embsim_update;
+extern embsim_flash_t                   embsim_runapp;
+extern embsim_flash_t                   embsim_backup;
+extern embsim_flash_t                   embsim_decode;
+extern embsim_flash_t                   embsim_scratch;
+
+extern struct fal_flash_dev             embsim_update_dev;
+extern struct fal_flash_dev             embsim_runapp_dev;
+extern struct fal_flash_dev             embsim_backup_dev;
+extern struct fal_flash_dev             embsim_decode_dev;
+extern struct fal_flash_dev             embsim_scratch_dev;
+
+#define EMBSIM_FLASH_DEV_TABLE          &embsim_update_dev, \
+                                        &embsim_runapp_dev, \
+                                        &embsim_backup_dev, \
+                                        &embsim_decode_dev, \
+                                        &embsim_scratch_dev,
+
+#define EMBSIM_PART_TABLE               {\
+                                            {FAL_PART_MAGIC_WORD, "update", "sim_update", 0, EMBSIM_UPDATE_SIZE, 0},\
+                                            {FAL_PART_MAGIC_WORD, "runapp", "sim_runapp", 0, EMBSIM_RUNAPP_SIZE, 0},\
+                                            {FAL_PART_MAGIC_WORD, "backup", "sim_backup", 0, EMBSIM_BACKUP_SIZE, 0},\
+                                            {FAL_PART_MAGIC_WORD, "decode", "sim_decode", 0, EMBSIM_DECODE_SIZE, 0},\
+                                            {FAL_PART_MAGIC_WORD, "scratch", "sim_scratch", 0, EMBSIM_SCRATCH_SIZE, 0},\
+                                        }
+
+#define EMBSIM_PART_DEVS                &embsim_update_dev, \
+                                        &embsim_runapp_dev, \
+                                        &embsim_backup_dev, \
+                                        &embsim_decode_dev, \
+                                        &embsim_scratch_dev
+
+int  embsim_init(void);
+void embsim_stat_get(embsim_stat_t *stat);
+void embsim_stat_sub(embsim_stat_t *stat, const embsim_stat_t *base);
+void embsim_jump(uint32_t msp, uintptr_t app);
+void embsim_yield(void);
+
+/* board glue expected by emboot.c */
+
+#ifndef __IO
+#define __IO                            volatile
+#endif
+
+#define __update_zone_addr              ((uintptr_t)embsim_update.mem)
+#define __update_zone_size              EMBSIM_UPDATE_SIZE
+#define __runapp_zone_addr              ((uintptr_t)embsim_runapp.mem)
+#define __decode_zone_addr              ((uintptr_t)embsim_decode.mem)
+
+#define emboot_jump_arch(msp, app)      embsim_jump(msp, app)
+#define emboot_yield()                  embsim_yield()
+
+#endif /* __emboot_sim_h__ */
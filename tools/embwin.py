@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2024, liujitong, <sulfurandcu@gmail.com>
+#
+# SPDX-License-Identifier: Apache-2.0
+#
+# host sender of the windowed download ("download -w"), see embwin_recv_on in emboot.c for the frame format.
+#
+#     python3 embwin.py /dev/ttyUSB0 921600 package.bin
+#
+# type "download -w" on the device first (or pass --command to have it typed).
+
+import argparse
+import struct
+import sys
+import time
+
+import serial
+
+
+def crc32_mpeg2(data, crc=0xFFFFFFFF):
+    for byte in data:
+        crc ^= byte << 24
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else (crc << 1)
+        crc &= 0xFFFFFFFF
+    return crc
+
+
+def frame(kind, index, payload=b''):
+    body = struct.pack('<BBHI', ord(kind), 0, len(payload), index) + payload
+    return b'\xA5\x5A' + body + struct.pack('<I', crc32_mpeg2(body))
+
+
+class Link:
+    def __init__(self, port):
+        self.port = port
+        self.rx = bytearray()
+
+    def recv(self, timeout):
+        """return (kind, index, payload), or None on timeout. corrupted frames are skipped."""
+        end = time.monotonic() + timeout
+        while True:
+            start = self.rx.find(b'\xA5\x5A')
+            if start < 0:
+                del self.rx[:max(len(self.rx) - 1, 0)]
+            else:
+                del self.rx[:start]
+                if len(self.rx) >= 10:
+                    kind, _, size, index = struct.unpack_from('<BBHI', self.rx, 2)
+                    if size > 16:
+                        del self.rx[:2]
+                        continue
+                    if len(self.rx) >= 10 + size + 4:
+                        body = bytes(self.rx[2:10 + size])
+                        crc, = struct.unpack_from('<I', self.rx, 10 + size)
+                        del self.rx[:10 + size + 4]
+                        if crc == crc32_mpeg2(body):
+                            return chr(kind), index, body[8:]
+                        continue
+            left = end - time.monotonic()
+            if left <= 0:
+                return None
+            self.port.timeout = min(left, 0.01)
+            self.rx += self.port.read(max(self.port.in_waiting, 1))
+
+
+def send(port, data, verbose=True):
+    link = Link(port)
+
+    # ready: window and frame size of the device.
+    end = time.monotonic() + 10
+    while True:
+        msg = link.recv(max(end - time.monotonic(), 0))
+        if msg is None:
+            raise RuntimeError('no ready frame from the device')
+        if msg[0] == 'R':
+            nums, size = struct.unpack('<II', msg[2][:8])
+            break
+
+    total = (len(data) + size - 1) // size
+    line = port.baudrate / 10
+    rto = 0.2 + 3 * nums * (size + 14) / line
+    t0 = time.monotonic()
+
+    base = None
+    for _ in range(10):
+        port.write(frame('H', 0, struct.pack('<I', len(data))))
+        msg = link.recv(rto)
+        while msg and msg[0] != 'S':
+            msg = link.recv(rto)
+        if msg:
+            base, bitmap = msg[1], struct.unpack('<I', msg[2][:4])[0]
+            break
+    if base is None:
+        raise RuntimeError('no answer to hello')
+
+    sent = {}                                   # index -> time sent
+    nxt = base
+    dups = 0
+    resent = 0
+    while base < total:
+        now = time.monotonic()
+        pick = None
+        for i in range(base, min(base + nums, total)):
+            acked = i > base and bitmap & (1 << (i - base - 1))
+            if not acked and (i >= nxt or now - sent.get(i, 0) > rto):
+                pick = i
+                break
+
+        if pick is not None:
+            resent += pick < nxt
+            port.write(frame('D', pick, data[pick * size:(pick + 1) * size]))
+            sent[pick] = time.monotonic()
+            nxt = max(nxt, pick + 1)
+
+        msg = link.recv(0 if pick is not None else 0.01)
+        while msg:
+            kind, index, payload = msg
+            if kind == 'C':
+                raise RuntimeError('cancelled by the device at frame %d' % index)
+            if kind == 'S':
+                mask, = struct.unpack('<I', payload[:4])
+                if index == base and mask and index < nxt:
+                    dups += 1
+                    if dups == 2:               # frames behind the missing one arrived, resend it
+                        sent[base] = 0
+                elif index != base:
+                    dups = 0
+                if index >= base:
+                    base, bitmap = index, mask
+            msg = link.recv(0)
+
+        if verbose:
+            sys.stdout.write('\r%3d%%' % (base * 100 // total))
+            sys.stdout.flush()
+
+    for _ in range(10):
+        port.write(frame('E', 0))
+        msg = link.recv(1)
+        if msg and msg[0] == 'S' and msg[1] >= total:
+            break
+    else:
+        raise RuntimeError('no answer to end')
+
+    wall = time.monotonic() - t0
+    if verbose:
+        print('\r%d bytes in %.2f s, %.1f KB/s, line %.1f KB/s (%.1f%%), %d resent'
+              % (len(data), wall, len(data) / wall / 1024, line / 1024, len(data) / wall * 100 / line, resent))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='windowed download sender for emboot')
+    parser.add_argument('port')
+    parser.add_argument('baud', type=int)
+    parser.add_argument('package')
+    parser.add_argument('--command', action='store_true', help='type "download -w" on the device first')
+    args = parser.parse_args()
+
+    with open(args.package, 'rb') as f:
+        data = f.read()
+
+    with serial.Serial(args.port, args.baud) as port:
+        if args.command:
+            port.write(b'download -w\r\n')
+        send(port, data)
+
+
+if __name__ == '__main__':
+    main()